@@ -6,61 +6,90 @@
 #include "defs.h"
 
 // Buddy allocator
+//
+// Manages physical memory in power-of-two blocks of pages
+// and backs kalloc(), whose per-CPU free lists take and give
+// back single pages in batches with bd_malloc_n() and
+// bd_free_n().
+//
+// bd_base is megapage-aligned, so blocks of up to MEGAPGSIZE
+// bytes are aligned to their size in physical memory too,
+// as megapage mappings require.
 
 static int nsizes;     // the number of entries in bd_sizes array
 
-#define LEAF_SIZE     16                         // The smallest block size
+#define LEAF_SHIFT    PGSHIFT
+#define LEAF_SIZE     (1L << LEAF_SHIFT)         // The smallest block size
 #define MAXSIZE       (nsizes-1)                 // Largest index in bd_sizes array
 #define BLK_SIZE(k)   ((1L << (k)) * LEAF_SIZE)  // Size of block at size k
-#define HEAP_SIZE     BLK_SIZE(MAXSIZE) 
+#define HEAP_SIZE     BLK_SIZE(MAXSIZE)
 #define NBLK(k)       (1 << (MAXSIZE-k))         // Number of block at size k
 #define ROUNDUP(n,sz) (((((n)-1)/(sz))+1)*(sz))  // Round up to the next multiple of sz
 
+
 typedef struct list Bd_list;
 
 // The allocator has sz_info for each size k. Each sz_info has a free
-// list, an array alloc to keep track which blocks have been
-// allocated, and an split array to to keep track which blocks have
-// been split.  The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// list and an array alloc to keep track which blocks have been
+// allocated (or split, which also counts as allocated). The array
+// uses 1 bit per block, in 64-bit words.
 struct sz_info {
   Bd_list free;
-  char *alloc;
-  char *split;
+  uint64 *alloc;
 };
 typedef struct sz_info Sz_info;
 
-static Sz_info *bd_sizes; 
+static Sz_info *bd_sizes;
 static void *bd_base;   // start address of memory managed by the buddy allocator
+static uchar *bd_tag;   // for each leaf, the size k of the allocated block starting there
+static uint64 bd_avail; // bit k is set iff bd_sizes[k].free is not empty
 static struct spinlock lock;
 
 // Return 1 if bit at position index in array is set to 1
-int bit_isset(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  return (b & m) == m;
+int bit_isset(uint64 *array, int index) {
+  return (array[index/64] >> (index % 64)) & 1;
 }
 
 // Set bit at position index in array to 1
-void bit_set(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b | m);
+void bit_set(uint64 *array, int index) {
+  array[index/64] |= (uint64)1 << (index % 64);
 }
 
 // Clear bit at position index in array
-void bit_clear(char *array, int index) {
-  char b = array[index/8];
-  char m = (1 << (index % 8));
-  array[index/8] = (b & ~m);
+void bit_clear(uint64 *array, int index) {
+  array[index/64] &= ~((uint64)1 << (index % 64));
+}
+
+// Set bits [lo, hi) in array, a whole word at a time where possible
+void bit_setrange(uint64 *array, int lo, int hi) {
+  for(; lo < hi && lo % 64 != 0; lo++)
+    bit_set(array, lo);
+  for(; lo + 64 <= hi; lo += 64)
+    array[lo/64] = ~(uint64)0;
+  for(; lo < hi; lo++)
+    bit_set(array, lo);
+}
+
+// Index of the lowest set bit in x, which must not be 0.
+// Uses a de Bruijn sequence, since __builtin_ctzl would
+// need libgcc, which the kernel does not link with.
+static int
+ctz64(uint64 x)
+{
+  static const uchar pos[64] = {
+     0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+    62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+    63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+    46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6,
+  };
+  return pos[((x & -x) * 0x03f79d71b4cb0a89L) >> 58];
 }
 
 // Print a bit vector as a list of ranges of 1 bits
 void
-bd_print_vector(char *vector, int len) {
+bd_print_vector(uint64 *vector, int len) {
   int last, lb;
-  
+
   last = 1;
   lb = 0;
   for (int b = 0; b < len; b++) {
@@ -85,10 +114,6 @@ bd_print() {
     lst_print(&bd_sizes[k].free);
     printf("  alloc:");
     bd_print_vector(bd_sizes[k].alloc, NBLK(k));
-    if(k > 0) {
-      printf("  split:");
-      bd_print_vector(bd_sizes[k].split, NBLK(k));
-    }
   }
 }
 
@@ -109,70 +134,80 @@ firstk(uint64 n) {
 int
 blk_index(int k, char *p) {
   int n = p - (char *) bd_base;
-  return n / BLK_SIZE(k);
+  return n >> (k + LEAF_SHIFT);
 }
 
 // Convert a block index at size k back into an address
 void *addr(int k, int bi) {
-  int n = bi * BLK_SIZE(k);
+  uint64 n = (uint64)bi << (k + LEAF_SHIFT);
   return (char *) bd_base + n;
 }
 
-// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
-void *
-bd_malloc(uint64 nbytes)
+// Free list operations that keep bd_avail up to date.
+// Caller must hold lock.
+static void
+bd_push(int k, void *p)
 {
-  int fk, k;
+  lst_push(&bd_sizes[k].free, p);
+  bd_avail |= (uint64)1 << k;
+}
 
-  acquire(&lock);
+static void *
+bd_pop(int k)
+{
+  void *p = lst_pop(&bd_sizes[k].free);
+  if(lst_empty(&bd_sizes[k].free))
+    bd_avail &= ~((uint64)1 << k);
+  return p;
+}
 
-  // Find a free block >= nbytes, starting with smallest k possible
-  fk = firstk(nbytes);
-  for (k = fk; k < nsizes; k++) {
-    if(!lst_empty(&bd_sizes[k].free))
-      break;
-  }
-  if(k >= nsizes) { // No free blocks?
-    release(&lock);
+static void
+bd_remove(int k, void *p)
+{
+  lst_remove(p);
+  if(lst_empty(&bd_sizes[k].free))
+    bd_avail &= ~((uint64)1 << k);
+}
+
+// Allocate a block of size fk from the free lists.
+// Caller must hold lock.
+static void *
+bd_alloc(int fk)
+{
+  uint64 avail;
+  int k;
+
+  // Find a free block >= size fk: the lowest bit of
+  // bd_avail at or above fk.
+  avail = bd_avail >> fk;
+  if(avail == 0) // No free blocks?
     return 0;
-  }
+  k = fk + ctz64(avail);
 
   // Found a block; pop it and potentially split it.
-  char *p = lst_pop(&bd_sizes[k].free);
+  char *p = bd_pop(k);
   bit_set(bd_sizes[k].alloc, blk_index(k, p));
   for(; k > fk; k--) {
     // split a block at size k and mark one half allocated at size k-1
     // and put the buddy on the free list at size k-1
     char *q = p + BLK_SIZE(k-1);   // p's buddy
-    bit_set(bd_sizes[k].split, blk_index(k, p));
     bit_set(bd_sizes[k-1].alloc, blk_index(k-1, p));
-    lst_push(&bd_sizes[k-1].free, q);
+    bd_push(k-1, q);
   }
-  release(&lock);
-
+  bd_tag[blk_index(0, p)] = fk;
   return p;
 }
 
-// Find the size of the block that p points to.
-int
-size(char *p) {
-  for (int k = 0; k < nsizes; k++) {
-    if(bit_isset(bd_sizes[k+1].split, blk_index(k+1, p))) {
-      return k;
-    }
-  }
-  return 0;
-}
-
-// Free memory pointed to by p, which was earlier allocated using
-// bd_malloc.
-void
-bd_free(void *p) {
+// Return block p to the free lists, merging it with its
+// buddy as far up as possible.
+// Caller must hold lock.
+static void
+bd_release(void *p)
+{
   void *q;
   int k;
 
-  acquire(&lock);
-  for (k = size(p); k < MAXSIZE; k++) {
+  for (k = bd_tag[blk_index(0, p)]; k < MAXSIZE; k++) {
     int bi = blk_index(k, p);
     int buddy = (bi % 2 == 0) ? bi+1 : bi-1;
     bit_clear(bd_sizes[k].alloc, bi);  // free p at size k
@@ -181,15 +216,85 @@ bd_free(void *p) {
     }
     // budy is free; merge with buddy
     q = addr(k, buddy);
-    lst_remove(q);    // remove buddy from free list
+    bd_remove(k, q);    // remove buddy from free list
     if(buddy % 2 == 0) {
       p = q;
     }
-    // at size k+1, mark that the merged buddy pair isn't split
-    // anymore
-    bit_clear(bd_sizes[k+1].split, blk_index(k+1, p));
   }
-  lst_push(&bd_sizes[k].free, p);
+  bd_push(k, p);
+}
+
+// allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
+void *
+bd_malloc(uint64 nbytes)
+{
+  void *p;
+  int fk;
+
+  fk = firstk(nbytes);
+  if(fk >= nsizes)
+    return 0;
+  acquire(&lock);
+  p = bd_alloc(fk);
+  release(&lock);
+  return p;
+}
+
+// Free memory pointed to by p, which was earlier allocated using
+// bd_malloc.
+void
+bd_free(void *p) {
+  acquire(&lock);
+  bd_release(p);
+  release(&lock);
+}
+
+// Allocate up to n leaves into p[0..], under one acquire of
+// the lock. Returns how many it allocated.
+int
+bd_malloc_n(int n, void **p)
+{
+  int got;
+
+  acquire(&lock);
+  for(got = 0; got < n && (p[got] = bd_alloc(0)) != 0; got++)
+    ;
+  release(&lock);
+  return got;
+}
+
+// Free the n leaves in p[0..n-1], which were allocated by
+// bd_malloc(LEAF_SIZE) or bd_malloc_n(), under one acquire
+// of the lock.
+void
+bd_free_n(int n, void **p)
+{
+  if(n == 0)
+    return;
+  acquire(&lock);
+  for(int i = 0; i < n; i++)
+    bd_release(p[i]);
+  release(&lock);
+}
+
+// Turn the allocated block p into separately allocated
+// leaves, each of which can later be freed on its own with
+// bd_free(). Used for megapages, whose pages may be unmapped
+// and freed one at a time.
+void
+bd_split(void *p)
+{
+  int k, bi0;
+
+  acquire(&lock);
+  bi0 = blk_index(0, p);
+  k = bd_tag[bi0];
+  // p is allocated at size k; mark every smaller block inside
+  // it allocated too, as if each leaf had been allocated.
+  for(int j = 0; j < k; j++)
+    bit_setrange(bd_sizes[j].alloc, blk_index(j, p), blk_index(j, p) + (1 << (k-j)));
+  for(int i = 0; i < (1 << k); i++)
+    bd_tag[bi0 + i] = 0;
   release(&lock);
 }
 
@@ -212,26 +317,15 @@ log2(uint64 n) {
   return k;
 }
 
-// Mark memory from [start, stop), starting at size 0, as allocated. 
+// Mark memory from [start, stop), starting at size 0, as allocated.
 void
 bd_mark(void *start, void *stop)
 {
-  int bi, bj;
-
   if (((uint64) start % LEAF_SIZE != 0) || ((uint64) stop % LEAF_SIZE != 0))
     panic("bd_mark");
 
-  for (int k = 0; k < nsizes; k++) {
-    bi = blk_index(k, start);
-    bj = blk_index_next(k, stop);
-    for(; bi < bj; bi++) {
-      if(k > 0) {
-        // if a block is allocated at size k, mark it as split too.
-        bit_set(bd_sizes[k].split, bi);
-      }
-      bit_set(bd_sizes[k].alloc, bi);
-    }
-  }
+  for (int k = 0; k < nsizes; k++)
+    bit_setrange(bd_sizes[k].alloc, blk_index(k, start), blk_index_next(k, stop));
 }
 
 // If a block is marked as allocated and the buddy is free, put the
@@ -244,13 +338,13 @@ bd_initfree_pair(int k, int bi) {
     // one of the pair is free
     free = BLK_SIZE(k);
     if(bit_isset(bd_sizes[k].alloc, bi))
-      lst_push(&bd_sizes[k].free, addr(k, buddy));   // put buddy on free list
+      bd_push(k, addr(k, buddy));   // put buddy on free list
     else
-      lst_push(&bd_sizes[k].free, addr(k, bi));      // put bi on free list
+      bd_push(k, addr(k, bi));      // put bi on free list
   }
   return free;
 }
-  
+
 // Initialize the free lists for each size k.  For each size k, there
 // are only two pairs that may have a buddy that should be on free list:
 // bd_left and bd_right.
@@ -262,7 +356,7 @@ bd_initfree(void *bd_left, void *bd_right) {
     int left = blk_index_next(k, bd_left);
     int right = blk_index(k, bd_right);
     free += bd_initfree_pair(k, left);
-    if(right <= left)
+    if(right <= left || right >= NBLK(k))  // no block past the end of memory
       continue;
     free += bd_initfree_pair(k, right);
   }
@@ -297,17 +391,19 @@ bd_init(void *base, void *end) {
   char *p = (char *) ROUNDUP((uint64)base, LEAF_SIZE);
   int sz;
 
-  initlock(&lock, "buddy");
-  bd_base = (void *) p;
+  initlock(&lock, "kmem_buddy");
+  // start at a megapage boundary; [bd_base, base) is marked
+  // allocated below, along with the metadata.
+  bd_base = (void *) MEGAPGROUNDDOWN((uint64)base);
 
-  // compute the number of sizes we need to manage [base, end)
-  nsizes = log2(((char *)end-p)/LEAF_SIZE) + 1;
-  if((char*)end-p > BLK_SIZE(MAXSIZE)) {
+  // compute the number of sizes we need to manage [bd_base, end)
+  nsizes = log2(((char *)end-(char *)bd_base)/LEAF_SIZE) + 1;
+  if((char*)end-(char *)bd_base > BLK_SIZE(MAXSIZE)) {
     nsizes++;  // round up to the next power of 2
   }
 
   printf("bd: memory sz is %d bytes; allocate an size array of length %d\n",
-         (char*) end - p, nsizes);
+         (char*) end - (char *)bd_base, nsizes);
 
   // allocate bd_sizes array
   bd_sizes = (Sz_info *) p;
@@ -317,31 +413,27 @@ bd_init(void *base, void *end) {
   // initialize free list and allocate the alloc array for each size k
   for (int k = 0; k < nsizes; k++) {
     lst_init(&bd_sizes[k].free);
-    sz = sizeof(char)* ROUNDUP(NBLK(k), 8)/8;
-    bd_sizes[k].alloc = p;
+    sz = sizeof(uint64) * ROUNDUP(NBLK(k), 64)/64;
+    bd_sizes[k].alloc = (uint64 *) p;
     memset(bd_sizes[k].alloc, 0, sz);
     p += sz;
   }
 
-  // allocate the split array for each size k, except for k = 0, since
-  // we will not split blocks of size k = 0, the smallest size.
-  for (int k = 1; k < nsizes; k++) {
-    sz = sizeof(char)* (ROUNDUP(NBLK(k), 8))/8;
-    bd_sizes[k].split = p;
-    memset(bd_sizes[k].split, 0, sz);
-    p += sz;
-  }
+  // allocate the size tags, one per leaf.
+  bd_tag = (uchar *) p;
+  memset(bd_tag, 0, NBLK(0));
+  p += NBLK(0);
   p = (char *) ROUNDUP((uint64) p, LEAF_SIZE);
 
   // done allocating; mark the memory range [base, p) as allocated, so
   // that buddy will not hand out that memory.
   int meta = bd_mark_data_structures(p);
-  
+
   // mark the unavailable memory range [end, HEAP_SIZE) as allocated,
   // so that buddy will not hand out that memory.
   int unavailable = bd_mark_unavailable(end, p);
   void *bd_end = bd_base+BLK_SIZE(MAXSIZE)-unavailable;
-  
+
   // initialize free lists for each size k
   int free = bd_initfree(p, bd_end);
 
@@ -351,4 +443,3 @@ bd_init(void *base, void *end) {
     panic("bd_init: free mem");
   }
 }
-
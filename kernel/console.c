@@ -7,6 +7,7 @@
 //   control-u -- kill line
 //   control-d -- end of file
 //   control-p -- print process list
+//   control-t -- print kernel memory statistics
 //
 
 #include <stdarg.h>
@@ -148,6 +149,10 @@ consoleintr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('T'):  // Print memory statistics.
+    slabdump();
+    swapdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF] != '\n'){
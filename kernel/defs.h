@@ -2,12 +2,15 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -24,6 +27,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -60,8 +64,16 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_mega(void);
+int             kalloc_n(int, void **);
+int             kalloc_zeroed_n(int, void **);
+void            kfree_n(int, void **);
 void            kfree(void *);
 void            kinit();
+int             kzero_idle(void);
+void            krefinc(void *);
+int             krefcount(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,7 +82,14 @@ void            begin_op(int);
 void            end_op(int);
 void            crash_op(int,int);
 
+// pcache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint);
+void            pcacheput(struct inode*, uint, uint64);
+void            pcacheinval(struct inode*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -85,18 +104,22 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, uint64, int);
 int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             nice(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedtick(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            sleepexcl(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
@@ -108,6 +131,17 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// ucopy.S
+uint64          ucopy(void*, void*, uint64);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            kmem_cache_grow(struct kmem_cache*, void*);
+void            slabdump(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -123,6 +157,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// sysfile.c
+int             spawnfiles(struct proc*, uint64, int);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -132,6 +169,22 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+void*           swapalloc(int);
+int             swapreclaim(void);
+int             swapin(pagetable_t, uint64);
+void            swapfree(pte_t);
+void            swapdump(void);
+
+// zram.c
+void            zraminit(void);
+void            zramfill(void);
+int             zramstore(int, void*);
+int             zramload(int, void*);
+void            zramfree(int);
+void            zramdump(void);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -140,6 +193,15 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timersinit(void);
+int             timerintr(void);
+void            tickstart(void);
+void            timerkick(int);
+void            timeradd(struct timer*, uint64, void*);
+int             timercancel(struct timer*);
+int             timersleep(uint64);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -158,20 +220,46 @@ void            kvminit(void);
 void            kvminithart(void);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
+pagetable_t     kvmcreate(void);
+void            kvmfree(pagetable_t);
+void            kvmsync(struct proc*);
+void            kvmswitch(struct proc*);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+uint64          uvmdirty(pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmzero(pagetable_t, uint64, int);
+int             uvmfault(struct proc*, uint64, int);
+pte_t*          uvmclock(pagetable_t, uint64*, uint64, void**);
+void            asidalloc(struct proc*);
+uint64          uvmsatp(struct proc*);
+void            uvmflush(pagetable_t, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// vma.c
+struct vma*     vmalookup(struct proc*, uint64);
+uint64          vmabase(struct proc*);
+uint64          vmamap(struct file*, uint64, int, int, uint64);
+int             vmaunmap(struct proc*, uint64, uint64);
+void            vmatrim(struct proc*, uint64);
+int             vmaoverlap(struct proc*, uint64, uint64);
+int             vmafault(struct proc*, struct vma*, uint64, int);
+int             vmacopy(struct proc*, struct proc*);
+void            vmaprefault(struct proc*, uint64, uint64, int);
+void            vmafree(struct proc*);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -181,6 +269,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(int);
 void            virtio_disk_rw(int, struct buf *, int);
+void            virtio_disk_rwpage(int, uint, void *, int);
 void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
@@ -193,6 +282,9 @@ void            virtio_disk_intr(int);
 void           bd_init(void*,void*);
 void           bd_free(void*);
 void           *bd_malloc(uint64);
+void           bd_split(void*);
+int            bd_malloc_n(int, void**);
+void           bd_free_n(int, void**);
 
 struct list {
   struct list *next;
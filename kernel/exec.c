@@ -5,21 +5,32 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
-
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
+#include "fcntl.h"
+
+// Replace the user memory of p with the program at path,
+// with arguments argv. p is the current process for exec(),
+// or a new one that does not run yet for spawn().
+// The program's segments are not read in here: each becomes
+// a VMA whose pages uvmfault() reads from the file on first
+// touch.
+// Returns argc, or -1 on error, with p unchanged.
 int
-exec(char *path, char **argv)
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint64 argc, sz, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma seg[NSEG], *v;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+
+  nseg = 0;
 
   begin_op(ROOTDEV);
 
@@ -38,7 +49,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where the program's segments come from.
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -49,23 +60,41 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz > USERTOP)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // segments in ascending order, without sharing a page.
+    if(ph.vaddr < PGROUNDUP(sz))
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(nseg == NSEG)
       goto bad;
+    v = &seg[nseg++];
+    v->start = ph.vaddr;
+    v->end = PGROUNDUP(ph.vaddr + ph.memsz);
+    v->prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    v->flags = MAP_PRIVATE;
+    v->f = 0;
+    v->ip = 0;
+    v->off = ph.off;
+    v->fileend = ph.vaddr + ph.filesz;
+    sz = ph.vaddr + ph.memsz;
   }
+  for(i = 0; i < nseg; i++)
+    seg[i].ip = idup(ip);
   iunlockput(ip);
   end_op(ROOTDEV);
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
+  if(sz + 2*PGSIZE > USERTOP)
+    goto bad;
   if((sz = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   uvmclear(pagetable, sz-2*PGSIZE);
@@ -106,9 +135,17 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmafree(p);
+  memmove(p->vma, seg, nseg*sizeof(seg[0]));
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  // point the kernel page table at the new image, and
+  // flush the old one's TLB entries.
+  if(p == myproc())
+    uvmflush(pagetable, 0, USERTOP);
+  else
+    kvmsync(p);
   p->tf->epc = elf.entry;  // initial program counter = main
   p->tf->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
@@ -122,33 +159,18 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op(ROOTDEV);
   }
+  for(i = 0; i < nseg; i++){
+    if(seg[i].ip){
+      begin_op(ROOTDEV);
+      iput(seg[i].ip);
+      end_op(ROOTDEV);
+    }
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+exec(char *path, char **argv)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+  return execproc(myproc(), path, argv);
 }
@@ -13,6 +13,13 @@
 #include "stat.h"
 #include "proc.h"
 
+// pipes, devices and inodes copy to and from user memory
+// holding locks under which a page fault cannot read in a
+// page (see vmafault()). fileread() and filewrite() fault in
+// the pages of a chunk of at most PREFAULT bytes just before
+// copying it, rather than the whole buffer.
+#define PREFAULT (8*PGSIZE)
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -106,22 +113,41 @@ filestat(struct file *f, uint64 addr)
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, i, n1;
 
   if(f->readable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
+    // a pipe holds at most PIPESIZE bytes to read.
+    vmaprefault(myproc(), addr, n < PREFAULT ? n : PREFAULT, 1);
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    // the console returns a line at a time.
+    vmaprefault(myproc(), addr, n < PREFAULT ? n : PREFAULT, 1);
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // a chunk at a time, so that a read past the end of the
+    // file faults in no more than one chunk beyond it.
+    for(i = 0; i < n; i += r){
+      n1 = n - i;
+      if(n1 > PREFAULT)
+        n1 = PREFAULT;
+      vmaprefault(myproc(), addr + i, n1, 1);
+      ilock(f->ip);
+      if((r = readi(f->ip, 1, addr + i, f->off, n1)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+      if(r != n1){
+        // the end of the file, or an error.
+        if(r > 0)
+          i += r;
+        break;
+      }
+    }
+    r = (i > 0 || r >= 0) ? i : -1;
   } else {
     panic("fileread");
   }
@@ -134,17 +160,30 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int r, ret = 0, i, n1;
 
   if(f->writable == 0)
     return -1;
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+  if(f->type == FD_PIPE || f->type == FD_DEVICE){
+    if(f->type == FD_DEVICE &&
+       (f->major < 0 || f->major >= NDEV || !devsw[f->major].write))
       return -1;
-    ret = devsw[f->major].write(f, 1, addr, n);
+    for(i = 0; i < n; i += n1){
+      n1 = n - i;
+      if(n1 > PREFAULT)
+        n1 = PREFAULT;
+      vmaprefault(myproc(), addr + i, n1, 0);
+      if(f->type == FD_PIPE)
+        r = pipewrite(f->pipe, addr + i, n1);
+      else
+        r = devsw[f->major].write(f, 1, addr + i, n1);
+      if(r < 0)
+        return -1;
+      if(r < n1)
+        return i + r;
+    }
+    ret = n;
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -153,12 +192,13 @@ filewrite(struct file *f, uint64 addr, int n)
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
+    i = 0;
     while(i < n){
-      int n1 = n - i;
+      n1 = n - i;
       if(n1 > max)
         n1 = max;
 
+      vmaprefault(myproc(), addr + i, n1, 0);
       begin_op(f->ip->dev);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
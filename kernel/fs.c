@@ -436,6 +436,7 @@ itrunc(struct inode *ip)
     ip->addrs[NDIRECT] = 0;
   }
 
+  pcacheinval(ip);
   ip->size = 0;
   iupdate(ip);
 }
@@ -506,6 +507,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   }
 
   if(n > 0){
+    pcacheinval(ip);
     if(off > ip->size)
       ip->size = off;
     // write the i-node back to disk even if the size didn't change
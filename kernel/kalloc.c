@@ -1,6 +1,25 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU has its own free list, so the common kalloc()
+// and kfree() paths only take that CPU's lock, which other
+// CPUs rarely touch. Pages move between the per-CPU lists
+// and the buddy allocator (buddy.c) in batches of
+// KMEM_BATCH. A CPU whose list is empty and that finds no
+// free pages in the buddy allocator steals half of some
+// other CPU's list.
+//
+// Idle CPUs also zero free pages ahead of time into a
+// per-CPU zeroed list, from which kalloc_zeroed() serves
+// page-table pages and fresh user memory without a memset
+// on the hot path. Build with -DKMEM_DEBUG to have kalloc()
+// and kfree() fill pages with junk.
+//
+// Each page has a reference count so that copy-on-write
+// fork can share a page between page tables: kalloc()
+// sets it to one, krefinc() adds a reference, and kfree()
+// only returns the page once the last reference is gone.
 
 #include "types.h"
 #include "param.h"
@@ -9,7 +28,10 @@
 #include "riscv.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
+#define KMEM_BATCH  32              // pages moved per refill or drain
+#define KMEM_HIGH   (2*KMEM_BATCH)  // drain a CPU list longer than this
+#define KMEM_NZERO  64              // pre-zeroed pages kept per CPU
+#define PA2REF(pa)  (((uint64)(pa) - KERNBASE) / PGSIZE)
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -18,48 +40,172 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct klist {
+  struct run *head;
+  int n;
+};
+
+struct kmem {
   struct spinlock lock;
-  struct run *freelist;
-} kmem;
+  struct klist free;
+  struct klist zero;   // pages known to be zero-filled
+};
+
+struct kmem kcpu[NCPU];  // per-CPU free lists
+
+// references to each physical page, updated atomically.
+int kref[PA2REF(PHYSTOP)];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem");
+  bd_init(end, (void*)PHYSTOP);
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Detach up to n pages from the front of list l.
+// Caller must hold the lock of the kmem that owns l.
+// Returns the detached chain, terminated by 0, and its
+// length in *got.
+static struct run *
+ktake(struct klist *l, int n, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = l->head;
+  if(head == 0 || n <= 0){
+    *got = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  l->head = r->next;
+  l->n -= i;
+  r->next = 0;
+  *got = i;
+  return head;
+}
+
+// Prepend a chain of n pages to list l.
+// Caller must hold the lock of the kmem that owns l.
+static void
+kput(struct klist *l, struct run *head, int n)
+{
+  struct run *r;
+
+  if(head == 0)
+    return;
+  for(r = head; r->next; r = r->next)
+    ;
+  r->next = l->head;
+  l->head = head;
+  l->n += n;
+}
+
+// Find pages for CPU id, whose own list is empty: first
+// a batch from the buddy allocator, otherwise half of
+// another CPU's list. As a last resort, dip into the
+// zeroed lists, starting with CPU id's own. Returns one
+// page and adds any others to CPU id's list. Never holds
+// two kmem locks at once, so CPUs stealing from each
+// other cannot deadlock.
+// Must be called with interrupts disabled.
+static struct run *
+krefill(int id)
+{
+  struct kmem *victim;
+  struct run *r;
+  void *pa[KMEM_BATCH];
+  int i, n;
+
+  r = 0;
+  n = bd_malloc_n(KMEM_BATCH, pa);
+  for(i = n - 1; i >= 0; i--){
+    ((struct run*)pa[i])->next = r;
+    r = pa[i];
+  }
+
+  for(i = 1; r == 0 && i < NCPU; i++){
+    victim = &kcpu[(id + i) % NCPU];
+    acquire(&victim->lock);
+    r = ktake(&victim->free, (victim->free.n + 1) / 2, &n);
+    release(&victim->lock);
+  }
+
+  for(i = 0; r == 0 && i < NCPU; i++){
+    victim = &kcpu[(id + i) % NCPU];
+    acquire(&victim->lock);
+    r = ktake(&victim->zero, (victim->zero.n + 1) / 2, &n);
+    release(&victim->lock);
+  }
+
+  if(r && r->next){
+    acquire(&kcpu[id].lock);
+    kput(&kcpu[id].free, r->next, n - 1);
+    release(&kcpu[id].lock);
+    r->next = 0;
+  }
+  return r;
+}
+
+// Put the n unreferenced pages in pa[] on this CPU's free
+// list, and hand the surplus above KMEM_HIGH back to the
+// buddy allocator, KMEM_BATCH pages at a time.
+static void
+kfreelist(int n, void **pa)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct kmem *km;
+  struct run *r;
+  void *batch[KMEM_BATCH];
+  int i;
+
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  for(i = 0; i < n; i++){
+    r = (struct run*)pa[i];
+    r->next = km->free.head;
+    km->free.head = r;
+    km->free.n++;
+  }
+  while(km->free.n > KMEM_HIGH){
+    for(i = 0; i < KMEM_BATCH; i++){
+      batch[i] = km->free.head;
+      km->free.head = km->free.head->next;
+    }
+    km->free.n -= KMEM_BATCH;
+    bd_free_n(KMEM_BATCH, batch);
+  }
+  release(&km->lock);
+  pop_off();
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: refcount");
+  if(n > 0)
+    return;
+
+#ifdef KMEM_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
-  r = (struct run*)pa;
-
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  kfreelist(1, &pa);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +215,244 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
+  int id;
+
+  push_off();
+  id = cpuid();
+  km = &kcpu[id];
+  acquire(&km->lock);
+  r = km->free.head;
+  if(r){
+    km->free.head = r->next;
+    km->free.n--;
+  }
+  release(&km->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
+
+  if(r == 0)
+    return 0;
+  kref[PA2REF(r)] = 1;
+
+#ifdef KMEM_DEBUG
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate n pages into pa[0..n-1], taking as many as it
+// can from this CPU's list under one acquire of its lock
+// and the rest from the buddy allocator in one batch.
+// Returns 0 on success, or -1 with nothing allocated.
+int
+kalloc_n(int n, void **pa)
+{
+  struct kmem *km;
+  struct run *r;
+  int i, got;
+
+  got = 0;
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  while(got < n && (r = km->free.head) != 0){
+    km->free.head = r->next;
+    km->free.n--;
+    pa[got++] = r;
+  }
+  release(&km->lock);
+  pop_off();
+  if(got < n)
+    got += bd_malloc_n(n - got, pa + got);
+  for(i = 0; i < got; i++)
+    kref[PA2REF(pa[i])] = 1;
+
+  // last resort: a page at a time, which can steal from
+  // the other CPUs.
+  for(; got < n; got++){
+    if((pa[got] = kalloc()) == 0){
+      kfree_n(got, pa);
+      return -1;
+    }
+  }
+#ifdef KMEM_DEBUG
+  for(i = 0; i < n; i++)
+    memset((char*)pa[i], 5, PGSIZE); // fill with junk
+#endif
+  return 0;
+}
+
+// Drop a reference to each of the n pages in pa[], like
+// kfree(), and free the unreferenced ones as one batch.
+// Reorders pa[].
+void
+kfree_n(int n, void **pa)
+{
+  int i, r, nfree;
+
+  nfree = 0;
+  for(i = 0; i < n; i++){
+    if(((uint64)pa[i] % PGSIZE) != 0 || (char*)pa[i] < end || (uint64)pa[i] >= PHYSTOP)
+      panic("kfree_n");
+    r = __sync_sub_and_fetch(&kref[PA2REF(pa[i])], 1);
+    if(r < 0)
+      panic("kfree_n: refcount");
+    if(r > 0)
+      continue;
+#ifdef KMEM_DEBUG
+    memset(pa[i], 1, PGSIZE); // fill with junk
+#endif
+    pa[nfree++] = pa[i];
+  }
+  if(nfree > 0)
+    kfreelist(nfree, pa);
+}
+
+// Allocate one zero-filled page, preferably one that an
+// idle CPU has already cleared.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kmem *km;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  r = km->zero.head;
+  if(r){
+    km->zero.head = r->next;
+    km->zero.n--;
+  }
+  release(&km->lock);
+  pop_off();
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    r->next = 0;  // the only non-zero word
+    kref[PA2REF(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Allocate n zero-filled pages into pa[0..n-1], like
+// kalloc_n(), taking as many as it can from this CPU's
+// zeroed list under one acquire of its lock.
+// Returns 0 on success, or -1 with nothing allocated.
+int
+kalloc_zeroed_n(int n, void **pa)
+{
+  struct kmem *km;
+  struct run *r;
+  int i, got;
+
+  got = 0;
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  while(got < n && (r = km->zero.head) != 0){
+    km->zero.head = r->next;
+    km->zero.n--;
+    r->next = 0;  // the only non-zero word
+    pa[got++] = r;
+  }
+  release(&km->lock);
+  pop_off();
+  for(i = 0; i < got; i++)
+    kref[PA2REF(pa[i])] = 1;
+
+  if(got < n && kalloc_n(n - got, pa + got) == 0){
+    for(i = got; i < n; i++)
+      memset(pa[i], 0, PGSIZE);
+    got = n;
+  }
+  if(got < n){
+    kfree_n(got, pa);
+    return -1;
+  }
+  return 0;
+}
+
+// Zero one free page into this CPU's zeroed list, if it
+// is not already full. Called by scheduler() when no hart
+// has anything to run. Takes the page from this CPU's free
+// list or the buddy allocator, never from other CPUs, so
+// that an idle hart does not drain their lists when memory
+// is short. Returns 1 if it zeroed a page, 0 if there was
+// nothing to do.
+int
+kzero_idle(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kcpu[cpuid()];
+  acquire(&km->lock);
+  if(km->zero.n >= KMEM_NZERO){
+    release(&km->lock);
+    pop_off();
+    return 0;
+  }
+  r = km->free.head;
+  if(r){
+    km->free.head = r->next;
+    km->free.n--;
+  }
+  release(&km->lock);
+
+  if(r == 0 && (r = bd_malloc(PGSIZE)) == 0){
+    pop_off();
+    return 0;
+  }
+
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&km->lock);
+  r->next = km->zero.head;
+  km->zero.head = r;
+  km->zero.n++;
+  release(&km->lock);
+  pop_off();
+  return 1;
+}
+
+// Allocate MEGAPGSIZE bytes of physically contiguous memory,
+// aligned to MEGAPGSIZE, for a megapage mapping. Each page in
+// it gets its own reference count and is freed with kfree()
+// on its own, so a megapage mapping can later be split up.
+// Returns 0 if no such block is free.
+void *
+kalloc_mega(void)
+{
+  char *pa;
+
+  if((pa = bd_malloc(MEGAPGSIZE)) == 0)
+    return 0;
+  bd_split(pa);
+  for(int i = 0; i < MEGAPGSIZE; i += PGSIZE)
+    kref[PA2REF(pa + i)] = 1;
+  return pa;
+}
+
+// Add a reference to an allocated page, for a
+// copy-on-write mapping that shares it.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  __sync_fetch_and_add(&kref[PA2REF(pa)], 1);
+}
+
+// Number of references to an allocated page.
+int
+krefcount(void *pa)
+{
+  return __atomic_load_n(&kref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
@@ -21,17 +21,23 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    timersinit();    // per-hart timers
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    pcacheinit();    // program page cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
+    zraminit();      // compressed swap in memory
+    swapinit();      // swap area on the second disk
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
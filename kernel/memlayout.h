@@ -28,9 +28,16 @@
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
+// the CLINT is where processes' kernel page tables map user
+// memory, so the kernel maps it at CLINTVA, above USERTOP,
+// instead. KCLINT() turns a CLINT address into that mapping.
+#define CLINTVA 0x0c400000L
+#define KCLINT(a) ((a) - CLINT + CLINTVA)
+
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -63,6 +70,12 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   USERTOP (PLIC; nothing user-accessible from here on)
+//   ...
 //   TRAPFRAME (p->tf, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// user memory ends below PLIC, so that a process's kernel
+// page table can map it at the same addresses (see kvmcreate()).
+#define USERTOP PLIC
@@ -1,6 +1,9 @@
 #define NPROC        10  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // mapped files per process
+#define NSEG          4  // loadable segments per program
+#define NPCACHE     128  // pages of program files cached
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
@@ -12,3 +15,7 @@
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
+#define NSWAP        65536  // pages of swap space on disk 1
+#define NICEMAX      19  // highest nice value
+#define TIMEFREQ     10000000  // time CSR counts per second, in qemu
+#define TICKTIME     (TIMEFREQ/10)  // time CSR counts per clock tick
@@ -0,0 +1,178 @@
+// Page cache for program files.
+//
+// exec() maps the segments of a program file, and uvmfault()
+// reads their pages in on first touch. The page cache keeps
+// the whole pages it read, keyed by (dev, inum, offset), so
+// that every process running the same program shares one
+// read-only copy of each page, copy-on-write if the segment
+// is writable, instead of reading in its own.
+//
+// Interface:
+// * pcacheget() returns a cached page with a reference for
+//     the caller, or 0.
+// * pcacheput() adds a page that the caller has read in,
+//     holding the inode's lock.
+// * pcacheinval() drops all of an inode's pages; writei()
+//     and itrunc() call it, holding the inode's lock, so a
+//     page read in under that lock is never stale when added.
+// A page's reference count includes one for the cache.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCBUCKET 31
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;
+  uint64 pa;             // 0 if unused
+  struct pcpage *hnext;  // in bucket[] of (dev, inum)
+  struct pcpage *prev;   // LRU list
+  struct pcpage *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+
+  // Linked list of all pages, through prev/next.
+  // head.next is most recently used.
+  struct pcpage head;
+
+  // the pages of each file are all in one bucket, so
+  // that pcacheinval() need not look at the others.
+  struct pcpage *bucket[NPCBUCKET];
+} pcache;
+
+static struct pcpage**
+pcbucket(uint dev, uint inum)
+{
+  return &pcache.bucket[(dev * 13 + inum) % NPCBUCKET];
+}
+
+void
+pcacheinit(void)
+{
+  struct pcpage *pg;
+
+  initlock(&pcache.lock, "pcache");
+
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+}
+
+// Move pg to the front of the LRU list.
+static void
+pctouch(struct pcpage *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pg->next = pcache.head.next;
+  pg->prev = &pcache.head;
+  pcache.head.next->prev = pg;
+  pcache.head.next = pg;
+}
+
+// Remove pg from its bucket, drop the cache's reference to
+// its page, and move it to the end of the LRU list, to be
+// reused first.
+static void
+pcdrop(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for(pp = pcbucket(pg->dev, pg->inum); *pp != pg; pp = &(*pp)->hnext)
+    ;
+  *pp = pg->hnext;
+  kfree((void*)pg->pa);
+  pg->pa = 0;
+
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pg->next = &pcache.head;
+  pg->prev = pcache.head.prev;
+  pcache.head.prev->next = pg;
+  pcache.head.prev = pg;
+}
+
+// Return the cached page of ip at file offset off, with a
+// reference for the caller, or 0.
+uint64
+pcacheget(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+  uint64 pa = 0;
+
+  acquire(&pcache.lock);
+  for(pg = *pcbucket(ip->dev, ip->inum); pg; pg = pg->hnext){
+    if(pg->dev == ip->dev && pg->inum == ip->inum && pg->off == off){
+      pa = pg->pa;
+      krefinc((void*)pa);
+      pctouch(pg);
+      break;
+    }
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Add pa, just read in from ip at file offset off, to the
+// cache, in place of the least recently used page.
+// Caller must hold ip's lock.
+void
+pcacheput(struct inode *ip, uint off, uint64 pa)
+{
+  struct pcpage *pg, **pp;
+
+  acquire(&pcache.lock);
+  pp = pcbucket(ip->dev, ip->inum);
+  for(pg = *pp; pg; pg = pg->hnext){
+    if(pg->dev == ip->dev && pg->inum == ip->inum && pg->off == off){
+      // another process read it in first.
+      release(&pcache.lock);
+      return;
+    }
+  }
+  pg = pcache.head.prev;
+  if(pg->pa)
+    pcdrop(pg);
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->off = off;
+  pg->pa = pa;
+  krefinc((void*)pa);
+  pg->hnext = *pp;
+  *pp = pg;
+  pctouch(pg);
+  release(&pcache.lock);
+}
+
+// Drop the cached pages of ip, whose contents are changing.
+// Processes that mapped them keep their old contents.
+// Caller must hold ip's lock.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcpage *pg, *next;
+
+  acquire(&pcache.lock);
+  for(pg = *pcbucket(ip->dev, ip->inum); pg; pg = next){
+    next = pg->hnext;
+    if(pg->dev == ip->dev && pg->inum == ip->inum)
+      pcdrop(pg);
+  }
+  release(&pcache.lock);
+}
@@ -18,8 +18,51 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Each hart has a queue of RUNNABLE processes to run next,
+// which is empty only if the hart has run out of work, or
+// others have stolen it. A process is on a queue from when
+// it becomes RUNNABLE until a scheduler() takes it off to
+// run it. Lock order: p->lock, then a queue's lock.
+//
+// The queue is a multi-level feedback queue: scheduler() runs
+// the processes of the highest level first, and a process
+// that uses up the quantum of its level, a tick at level 0
+// and twice as many at each level below, drops a level. So
+// interactive processes, which sleep before that, stay above
+// those that compute. Every BOOSTTICKS ticks all processes go
+// back to the level of their nice value, so that none
+// starves.
+#define NLEVEL 4
+#define BOOSTTICKS 50
+#define NICELEVEL(nice) ((nice) * NLEVEL / (NICEMAX + 1))
+static int quantum[NLEVEL] = { 1, 2, 4, 8 };
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NLEVEL];
+  struct proc *tail[NLEVEL];
+  int n;
+  int boost;          // ticks/BOOSTTICKS when last boosted
+} runq[NCPU];
+
+// A SLEEPING process is on the wait queue that its chan hashes
+// to, so that wakeup() looks only at the processes that might
+// be sleeping on its chan. A process goes from SLEEPING to
+// RUNNABLE only with its wait queue's lock held, which
+// wakeup() holds instead of p->lock. Lock order: p->lock, then
+// a wait queue's lock, then a run queue's lock.
+#define NWAITQ 61
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+} waitq[NWAITQ];
+
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
+static void freeproc(struct proc *p);
+static void runqput(struct proc *p);
+static void wake(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -29,6 +72,10 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -107,6 +154,10 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->state = USED;
+  p->cpu = cpuid();
+  p->nice = 0;
+  p->boost = -1;  // runqput() starts it at its nice level.
 
   // Allocate a trapframe page.
   if((p->tf = (struct trapframe *)kalloc()) == 0){
@@ -116,6 +167,14 @@ found:
 
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
+  asidalloc(p);
+
+  // A kernel page table, to map the user pages too.
+  if((p->kpagetable = kvmcreate()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -138,12 +197,17 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  if(p->kpagetable)
+    kvmfree(p->kpagetable);
+  p->kpagetable = 0;
   p->sz = 0;
+  p->nfault = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
+  p->userpreempt = 0;
   p->xstate = 0;
   p->state = UNUSED;
 }
@@ -179,8 +243,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
   uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
-  if(sz > 0)
-    uvmfree(pagetable, sz);
+  uvmfree(pagetable, sz);
 }
 
 // a user program that calls exec("/init")
@@ -207,6 +270,7 @@ userinit(void)
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
+  kvmsync(p);
   p->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
@@ -216,7 +280,7 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runqput(p);
 
   release(&p->lock);
 }
@@ -226,16 +290,19 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // pages are allocated on first touch, by uvmfault().
+    if(sz + n > vmabase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz)
+      return -1;
+    vmatrim(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -254,16 +321,25 @@ fork(void)
   if((np = allocproc()) == 0){
     return -1;
   }
+  // np is USED, so it stays ours without np->lock, which
+  // cannot be held while uvmcopy() swaps p's pages back in.
+  release(&np->lock);
 
   // Copy user memory from parent to child.
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
-
-  np->parent = p;
+  if(vmacopy(p, np) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  kvmsync(np);
 
   // copy saved user registers.
   *(np->tf) = *(p->tf);
@@ -278,11 +354,65 @@ fork(void)
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->nice = p->nice;
 
+  acquire(&np->lock);
+  np->parent = p;
   pid = np->pid;
+  runqput(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a new process running the program at path with
+// arguments argv, as fork() and then exec() in the child
+// would, but without copying the caller's memory. The child
+// gets copies of the caller's open files, changed by the nact
+// file actions at user address uact (see spawn.h).
+// Returns the child's pid, or -1 on error.
+int
+spawn(char *path, char **argv, uint64 uact, int nact)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0)
+    return -1;
+  // np is USED, so it stays ours without np->lock, which
+  // cannot be held while loading the program sleeps.
+  release(&np->lock);
 
-  np->state = RUNNABLE;
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  np->nice = p->nice;
+  memset(np->tf, 0, sizeof(*np->tf));
+
+  if(spawnfiles(np, uact, nact) < 0 || (argc = execproc(np, path, argv)) < 0){
+    for(i = 0; i < NOFILE; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    }
+    begin_op(ROOTDEV);
+    iput(np->cwd);
+    end_op(ROOTDEV);
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->tf->a0 = argc;
 
+  acquire(&np->lock);
+  np->parent = p;
+  pid = np->pid;
+  runqput(np);
   release(&np->lock);
 
   return pid;
@@ -325,6 +455,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and unmap mapped files.
+  vmafree(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -386,7 +519,7 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -406,17 +539,16 @@ wait(uint64 addr)
         acquire(&np->lock);
         havekids = 1;
         if(np->state == ZOMBIE){
-          // Found one.
+          // Found one. copyout() after releasing the locks,
+          // since it may have to swap the page in.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
+          xstate = np->xstate;
           freeproc(np);
           release(&np->lock);
           release(&p->lock);
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
@@ -434,10 +566,143 @@ wait(uint64 addr)
   }
 }
 
+// Append p to level l of q, whose lock the caller holds.
+static void
+runqappend(struct runq *q, int l, struct proc *p)
+{
+  p->rqnext = 0;
+  if(q->tail[l])
+    q->tail[l]->rqnext = p;
+  else
+    q->head[l] = p;
+  q->tail[l] = p;
+}
+
+// Move p back to the level of its nice value, with a fresh
+// quantum, if it has not been since the last boost.
+static void
+boostproc(struct proc *p)
+{
+  if(p->boost != ticks / BOOSTTICKS){
+    p->boost = ticks / BOOSTTICKS;
+    p->level = NICELEVEL(p->nice);
+    p->used = 0;
+  }
+}
+
+// Make p RUNNABLE, at the tail of its level of the run queue
+// of the hart it last ran on. Caller must hold p->lock, or, if
+// p is SLEEPING, the lock of its wait queue.
+static void
+runqput(struct proc *p)
+{
+  struct runq *q = &runq[p->cpu];
+  int i;
+
+  p->state = RUNNABLE;
+  boostproc(p);
+  acquire(&q->lock);
+  runqappend(q, p->level, p);
+  q->n++;
+  release(&q->lock);
+
+  // wake the hart if it is idle, or else another idle one to
+  // steal p.
+  if(cpus[p->cpu].idle){
+    timerkick(p->cpu);
+    return;
+  }
+  for(i = 0; i < NCPU; i++){
+    if(cpus[i].idle){
+      timerkick(i);
+      return;
+    }
+  }
+}
+
+// Is any run queue non-empty?
+static int
+runqwork(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    if(runq[i].n)
+      return 1;
+  return 0;
+}
+
+// Take the process at the head of the highest non-empty level
+// of hart id's run queue off it, or return 0 if it is empty.
+// Boosts the queue's processes first if it is time to.
+static struct proc*
+runqget(int id)
+{
+  struct runq *q = &runq[id];
+  struct proc *p, *all;
+  int l;
+
+  acquire(&q->lock);
+  if(q->boost != ticks / BOOSTTICKS){
+    q->boost = ticks / BOOSTTICKS;
+    // take them all off, in order of level, and put each
+    // back on its new level.
+    all = 0;
+    for(l = NLEVEL-1; l >= 0; l--){
+      if(q->tail[l]){
+        q->tail[l]->rqnext = all;
+        all = q->head[l];
+      }
+      q->head[l] = q->tail[l] = 0;
+    }
+    while((p = all) != 0){
+      all = p->rqnext;
+      boostproc(p);
+      runqappend(q, p->level, p);
+    }
+  }
+  p = 0;
+  for(l = 0; l < NLEVEL; l++){
+    if((p = q->head[l]) != 0){
+      q->head[l] = p->rqnext;
+      if(q->head[l] == 0)
+        q->tail[l] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+// Take a process from the longest run queue, for a hart
+// whose own is empty, or return 0 if all are empty.
+static struct proc*
+runqsteal(void)
+{
+  struct proc *p;
+  int i, best, n;
+
+  for(;;){
+    // the lengths can change under us; runqget() decides.
+    best = -1;
+    n = 0;
+    for(i = 0; i < NCPU; i++){
+      if(runq[i].n > n){
+        n = runq[i].n;
+        best = i;
+      }
+    }
+    if(best < 0)
+      return 0;
+    if((p = runqget(best)) != 0)
+      return p;
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process off this CPU's run queue, or steal
+//    one from the longest queue of another.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -452,38 +717,56 @@ scheduler(void)
     // Avoid deadlock by giving devices a chance to interrupt.
     intr_on();
 
-    // Run the for loop with interrupts off to avoid
-    // a race between an interrupt and WFI, which would
-    // cause a lost wakeup.
+    // Look for work with interrupts off to avoid a race
+    // between an interrupt and WFI, which would cause a
+    // lost wakeup.
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->scheduler, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
+    if((p = runqget(cpuid())) == 0 && (p = runqsteal()) == 0){
+      // nothing to run anywhere: zero a page for
+      // kalloc_zeroed() if there is one to zero, otherwise
+      // wait for an interrupt. the tick stops meanwhile, so
+      // runqput() kicks an idle hart when there is work;
+      // look once more after saying that this one is idle.
+      if(kzero_idle() == 0){
+        c->idle = 1;
+        __sync_synchronize();
+        if(runqwork() == 0)
+          asm volatile("wfi");
+        c->idle = 0;
       }
+      continue;
+    }
+    tickstart();
 
-      // ensure that release() doesn't enable interrupts.
-      // again to avoid a race between interrupt and WFI.
-      c->intena = 0;
+    // p stays RUNNABLE, and so allocated, off the queue. its
+    // lock may still be held by the scheduler() it last
+    // yielded to, until that has switched away from it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = cpuid();
+    c->proc = p;
+    kvmswitch(p);
+    swtch(&c->scheduler, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    // Leave its kernel page table before releasing p->lock,
+    // after which wait() may free it.
+    kvmswitch(0);
+    c->proc = 0;
+
+    // ensure that release() doesn't enable interrupts.
+    // again to avoid a race between interrupt and WFI.
+    c->intena = 0;
 
-      release(&p->lock);
-    }
-    if(found == 0){
-      asm volatile("wfi");
-    }
+    release(&p->lock);
   }
 }
 
@@ -514,13 +797,57 @@ sched(void)
   mycpu()->intena = intena;
 }
 
+// Charge the current process for a timer interrupt. Returns
+// 1 if it should give up the CPU: it has used up its quantum,
+// and dropped a level, or a process of a higher level waits
+// on its hart's run queue.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *q = &runq[p->cpu];
+  int l;
+
+  if(++p->used >= quantum[p->level]){
+    if(p->level < NLEVEL-1)
+      p->level++;
+    p->used = 0;
+    return 1;
+  }
+  // without q->lock: a stale answer costs at most a tick.
+  for(l = 0; l < p->level; l++)
+    if(q->head[l])
+      return 1;
+  return 0;
+}
+
+// Add incr to the current process's nice value, which is
+// between 0 and NICEMAX; a higher one starts the process
+// at a lower level. Returns the new value.
+int
+nice(int incr)
+{
+  struct proc *p = myproc();
+
+  p->nice += incr;
+  if(p->nice < 0)
+    p->nice = 0;
+  if(p->nice > NICEMAX)
+    p->nice = NICEMAX;
+  if(p->level < NICELEVEL(p->nice)){
+    p->level = NICELEVEL(p->nice);
+    p->used = 0;
+  }
+  return p->nice;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runqput(p);
   sched();
   release(&p->lock);
 }
@@ -546,27 +873,43 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+static struct waitq*
+waitqof(void *chan)
+{
+  return &waitq[(uint64)chan % NWAITQ];
+}
+
+static void
+sleepon(void *chan, struct spinlock *lk, int excl)
 {
   struct proc *p = myproc();
+  struct waitq *q = waitqof(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once p is on chan's wait queue, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the wait queue),
   // so it's okay to release lk.
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
   }
 
   // Go to sleep.
+  acquire(&q->lock);
   p->chan = chan;
+  p->excl = excl;
   p->state = SLEEPING;
+  p->wqnext = 0;
+  if(q->tail)
+    q->tail->wqnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  release(&q->lock);
+
+  if(lk != &p->lock)
+    release(lk);
 
   sched();
 
@@ -580,20 +923,71 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
 void
-wakeup(void *chan)
+sleep(void *chan, struct spinlock *lk)
 {
-  struct proc *p;
+  sleepon(chan, lk, 0);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+// Like sleep(), but a wakeup() of chan wakes only the first
+// of the processes sleeping on it this way, for waiters of
+// which only one can go on, such as for a sleep lock.
+void
+sleepexcl(void *chan, struct spinlock *lk)
+{
+  sleepon(chan, lk, 1);
+}
+
+// Wake up all processes sleeping on chan with sleep(), and the
+// one that has waited longest with sleepexcl().
+void
+wakeup(void *chan)
+{
+  struct waitq *q = waitqof(chan);
+  struct proc *p, **pp, *last;
+  int woke1 = 0;
+
+  acquire(&q->lock);
+  last = 0;
+  for(pp = &q->head; (p = *pp) != 0; ){
+    if(p->chan == chan && (!p->excl || !woke1)){
+      woke1 |= p->excl;
+      *pp = p->wqnext;
+      runqput(p);
+    } else {
+      last = p;
+      pp = &p->wqnext;
     }
-    release(&p->lock);
   }
+  q->tail = last;
+  release(&q->lock);
+}
+
+// Wake p if it is sleeping, whatever its chan.
+// Caller must hold p->lock, so p cannot start sleeping.
+static void
+wake(struct proc *p)
+{
+  struct waitq *q;
+  struct proc **pp, *last;
+
+  if(p->state != SLEEPING)
+    return;
+  q = waitqof(p->chan);
+  acquire(&q->lock);
+  // a wakeup() may have got there first.
+  if(p->state == SLEEPING){
+    last = 0;
+    for(pp = &q->head; *pp != p; pp = &(*pp)->wqnext)
+      last = *pp;
+    *pp = p->wqnext;
+    if(q->tail == p)
+      q->tail = last;
+    runqput(p);
+  }
+  release(&q->lock);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -603,9 +997,8 @@ wakeup1(struct proc *p)
 {
   if(!holding(&p->lock))
     panic("wakeup1");
-  if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
-  }
+  if(p->chan == p)
+    wake(p);
 }
 
 // Kill the process with the given pid.
@@ -620,10 +1013,8 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      // Wake process from sleep().
+      wake(p);
       release(&p->lock);
       return 0;
     }
@@ -670,6 +1061,7 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
@@ -686,7 +1078,7 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s faults %d level %d", p->pid, state, p->name, (int)p->nfault, p->level);
     printf("\n");
   }
 }
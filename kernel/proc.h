@@ -24,6 +24,8 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this hart's TLB is clean for
+  int idle;                   // Waiting in scheduler() for work, with no tick
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,7 +82,22 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+// A mapping of part of a file into user memory, made by
+// mmap(), or by exec() for a segment of the program, which
+// lies below p->sz. Its pages are read in on first touch.
+struct vma {
+  uint64 start;                // First address
+  uint64 end;                  // One past the last address
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file, referenced; 0 for a segment
+  struct inode *ip;            // f's inode, or a segment's referenced one;
+                               // 0 if unused
+  uint64 off;                  // Offset in the file of start
+  uint64 fileend;              // Zero from here up, not read (bss)
+};
+
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
@@ -93,14 +110,32 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int userpreempt;             // Yielded at a timer interrupt in user space
+  int cpu;                     // Hart whose run queue p goes on
+  struct proc *rqnext;         // Next on that run queue
+  struct proc *wqnext;         // Next on chan's wait queue
+  int excl;                    // Sleeping for a wakeup() of only one
+
+  // the scheduler's; changed only by the process itself, or
+  // while it is on a run queue, with the queue's lock held.
+  int nice;                    // 0 to NICEMAX; higher runs at lower levels
+  int level;                   // Level of the run queues
+  int used;                    // Ticks of its quantum at the level used
+  int boost;                   // ticks/BOOSTTICKS when last boosted
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // Page table
+  pagetable_t kpagetable;      // Kernel page table, with the user pages
+  uint64 nfault;               // Pages mapped on first touch
+  int asid;                    // Address-space ID of pagetable
+  uint64 asidgen;              // Generation asid belongs to
+  int asidcpu;                 // Hart that last ran with asid, or -1
   struct trapframe *tf;        // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // Mapped files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,286 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// Each object type has a cache (struct kmem_cache) that
+// carves whole pages from kalloc() into equal-sized
+// objects. A page and the header at its start form a
+// slab; a cache keeps its slabs on full, partial and empty
+// lists. kmem_cache_free() finds an object's slab by
+// rounding the object's address down to a page boundary.
+//
+// An optional constructor runs once per object when its
+// slab is created, not on every allocation, so callers must
+// return objects to the cache in their constructed state.
+//
+// In front of the slab lists, each CPU has a small
+// magazine of free objects that it can allocate from and
+// free to with interrupts off and no lock at all. Only a
+// magazine that is empty (or full) takes the cache lock,
+// to move SLAB_MAG/2 objects at once.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NSLABCACHE  16   // maximum number of caches
+#define SLAB_MAG    8    // objects in a per-CPU magazine
+#define SLAB_MAXOBJ 255  // objects per slab; indices must fit a uchar
+#define SLAB_NONE   0xff // end of a slab's free index chain
+
+struct slab {
+  struct list link;          // on one of the cache's lists
+  struct kmem_cache *cache;
+  int inuse;                 // objects handed out
+  int free;                  // index of first free object, or SLAB_NONE
+  uchar next[];              // free chain: index of the next free object
+};
+
+struct kmem_mag {
+  int n;
+  void *obj[SLAB_MAG];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;                 // object size, rounded up
+  uint off;                  // offset of the first object in a slab
+  int nobj;                  // objects per slab
+  void (*ctor)(void*);
+
+  struct list full;
+  struct list partial;
+  struct list empty;
+
+  // statistics.
+  int nslab;                 // slabs (pages) owned by the cache
+  int nactive;               // objects outside the slabs, incl. magazines
+  uint64 nalloc;             // successful allocations, updated atomically
+
+  struct kmem_mag mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache cache[NSLABCACHE];
+} slabtab;
+
+void
+slabinit(void)
+{
+  initlock(&slabtab.lock, "slab");
+}
+
+// Create a cache of objects of the given size. ctor,
+// if non-zero, initializes each object once when the
+// page holding it is added to the cache.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void*))
+{
+  struct kmem_cache *c;
+  uint off;
+  int nobj;
+
+  size = (size + 7) & ~7;
+  for(nobj = SLAB_MAXOBJ; nobj > 0; nobj--){
+    off = (sizeof(struct slab) + nobj + 7) & ~7;
+    if(off + nobj * size <= PGSIZE)
+      break;
+  }
+  if(nobj < 2)
+    panic("kmem_cache_create: object too large");
+
+  acquire(&slabtab.lock);
+  if(slabtab.n >= NSLABCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabtab.cache[slabtab.n++];
+  release(&slabtab.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->off = off;
+  c->nobj = nobj;
+  c->ctor = ctor;
+  lst_init(&c->full);
+  lst_init(&c->partial);
+  lst_init(&c->empty);
+  return c;
+}
+
+static void*
+slab_obj(struct kmem_cache *c, struct slab *s, int i)
+{
+  return (char*)s + c->off + i * c->size;
+}
+
+// Make the page at s an empty slab of c.
+// Caller must hold c->lock.
+static void
+slab_init(struct kmem_cache *c, struct slab *s)
+{
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for(int i = 0; i < c->nobj; i++){
+    s->next[i] = (i + 1 < c->nobj) ? i + 1 : SLAB_NONE;
+    if(c->ctor)
+      c->ctor(slab_obj(c, s, i));
+  }
+  lst_push(&c->empty, s);
+  c->nslab++;
+}
+
+// Add a fresh page to c's empty list.
+// Caller must hold c->lock.
+static int
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  slab_init(c, s);
+  return 0;
+}
+
+// Take one object out of the slabs.
+// Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *o;
+
+  if(lst_empty(&c->partial)){
+    if(lst_empty(&c->empty) && slab_grow(c) < 0)
+      return 0;
+    s = lst_pop(&c->empty);
+    lst_push(&c->partial, s);
+  } else {
+    s = (struct slab*)c->partial.next;
+  }
+
+  o = slab_obj(c, s, s->free);
+  s->free = s->next[s->free];
+  s->inuse++;
+  if(s->free == SLAB_NONE){
+    lst_remove(&s->link);
+    lst_push(&c->full, s);
+  }
+  c->nactive++;
+  return o;
+}
+
+// Return one object to its slab. Keeps at most one empty
+// slab per cache and gives further empty pages back to
+// kalloc().
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *o)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)o);
+  int i;
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  i = ((char*)o - (char*)s - c->off) / c->size;
+
+  if(s->free == SLAB_NONE){
+    lst_remove(&s->link);
+    lst_push(&c->partial, s);
+  }
+  s->next[i] = s->free;
+  s->free = i;
+  s->inuse--;
+  c->nactive--;
+
+  if(s->inuse == 0){
+    lst_remove(&s->link);
+    if(lst_empty(&c->empty)){
+      lst_push(&c->empty, s);
+    } else {
+      c->nslab--;
+      kfree((void*)s);
+    }
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmem_mag *m;
+  void *o;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    // refill half the magazine, plus one to return.
+    acquire(&c->lock);
+    while(m->n < SLAB_MAG/2 + 1 && (o = slab_get(c)) != 0)
+      m->obj[m->n++] = o;
+    release(&c->lock);
+  }
+  o = 0;
+  if(m->n > 0){
+    o = m->obj[--m->n];
+    __sync_fetch_and_add(&c->nalloc, 1);
+  }
+  pop_off();
+  return o;
+}
+
+// Return object o, in its constructed state, to cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct kmem_mag *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == SLAB_MAG){
+    // flush half the magazine back to the slabs.
+    acquire(&c->lock);
+    while(m->n > SLAB_MAG/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Give cache c the page at pa, from kalloc(), as a new slab,
+// for a caller that keeps pages aside for when kalloc() has
+// none. The page goes back to kalloc() once it is empty.
+void
+kmem_cache_grow(struct kmem_cache *c, void *pa)
+{
+  acquire(&c->lock);
+  slab_init(c, (struct slab*)pa);
+  release(&c->lock);
+}
+
+// Print occupancy of each cache to the console.
+// Runs when user types ^T on console.
+// No lock to avoid wedging a stuck machine further.
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+  int cached;
+
+  printf("\n");
+  for(c = slabtab.cache; c < &slabtab.cache[slabtab.n]; c++){
+    cached = 0;
+    for(int i = 0; i < NCPU; i++)
+      cached += c->mag[i].n;
+    printf("slab %s: objsz %d, %d/%d objs in use (%d in magazines), %d pages, %d allocs\n",
+           c->name, c->size, c->nactive - cached, c->nslab * c->nobj,
+           cached, c->nslab, (int)c->nalloc);
+  }
+}
@@ -23,7 +23,7 @@ acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   while (lk->locked) {
-    sleep(lk, &lk->lk);
+    sleepexcl(lk, &lk->lk);
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
@@ -0,0 +1,16 @@
+// File actions for spawn(), applied in order to the new
+// process's copies of the caller's open files, before it
+// starts running the program.
+#define SPAWN_OPEN  1  // open path with mode as fd
+#define SPAWN_DUP2  2  // make newfd refer to fd's file
+#define SPAWN_CLOSE 3  // close fd
+
+#define MAXSPAWNACT 16 // most actions per spawn()
+
+struct spawnact {
+  int type;
+  int fd;
+  int newfd;   // SPAWN_DUP2
+  int mode;    // SPAWN_OPEN, as for open()
+  char *path;  // SPAWN_OPEN
+};
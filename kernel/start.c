@@ -38,6 +38,9 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the time CSR.
+  w_mcounteren(r_mcounteren() | 2);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -52,24 +55,23 @@ start()
 // set up to receive timer interrupts in machine mode,
 // which arrive at timervec in kernelvec.S,
 // which turns them into software interrupts for
-// devintr() in trap.c.
+// devintr() in trap.c. timer.c sets mtimecmp.
 void
 timerinit()
 {
   // each CPU has a separate source of timer interrupts.
   int id = r_mhartid();
 
-  // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  // no timer interrupt until timer.c asks for one.
+  *(uint64*)CLINT_MTIMECMP(id) = -1;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..3] : space for timervec to save registers.
   // scratch[4] : address of CLINT MTIMECMP register.
-  // scratch[5] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : address of CLINT MSIP register.
   uint64 *scratch = &mscratch0[32 * id];
   scratch[4] = CLINT_MTIMECMP(id);
-  scratch[5] = interval;
+  scratch[5] = CLINT_MSIP(id);
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -78,6 +80,7 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer interrupts, and the software
+  // interrupts of timerkick().
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
 }
@@ -0,0 +1,324 @@
+//
+// Swapping of anonymous user pages to the second virtio disk.
+//
+// When a page fault finds no free memory, swapalloc() calls
+// swapreclaim(), which runs a clock over the user memory below
+// p->sz of the processes: a page accessed since the clock last
+// passed it gets another chance, and one that was not, and
+// that no one else shares, is written to a free slot of the
+// swap area. Its PTE then holds the slot, with PTE_SWAP and
+// without PTE_V, and uvmfault() reads it back in on the next
+// touch.
+//
+// zram.c keeps what compresses well in memory instead, and
+// only the rest is written to the disk.
+//
+// Only the current process, at a page fault, and processes
+// that a timer interrupt preempted in user space give up
+// pages: the kernel holds no pointers into their memory and
+// is not about to copy to or from it under a spin lock, when
+// a page fault could not sleep to read the page back in.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define SWAPDEV 1         // virtio disk of the swap area
+#define SWAPBATCH 8       // most pages swapped out at once
+
+// A swapped-out page's PTE: the slot in place of the PPN, and
+// the page's permissions.
+#define SLOT2PTE(s, pte) ((((uint64)(s)) << 10) | \
+                          (PTE_FLAGS(pte) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP)
+#define PTE2SLOT(pte) ((int)(((pte) & ~PTE_SWAP) >> 10))
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+  uint64 used[NSWAP/64];  // bitmap of slots in use
+  int next;               // first slot to look at for a free one
+  int nused;
+
+  // the clock hand.
+  int proc;               // index in proc[]
+  uint64 va;
+
+  // a page-table page for uvmclock() to split a megapage
+  // with when memory has run out.
+  void *spare;
+
+  uint64 nout;            // pages swapped out
+  uint64 nin;             // pages swapped in
+  uint64 nzin;            // of those, from zram
+  uint64 zintime;         // time spent on swapin() from zram,
+  uint64 dintime;         // and from the disk
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  if((swap.spare = kalloc()) == 0)
+    panic("swapinit");
+  virtio_disk_init(SWAPDEV);
+}
+
+// Is the caller holding a spin lock, so that it must not sleep?
+static int
+swapbusy(void)
+{
+  int busy;
+
+  push_off();
+  busy = mycpu()->noff > 1;
+  pop_off();
+  return busy;
+}
+
+// Allocate a swap slot. Returns its number, or -1 if the swap
+// area is full.
+static int
+slotalloc(void)
+{
+  int i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAP; i++){
+    s = (swap.next + i) % NSWAP;
+    if((swap.used[s/64] & (1L << (s%64))) == 0){
+      swap.used[s/64] |= 1L << (s%64);
+      swap.next = s + 1;
+      swap.nused++;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+static void
+slotfree(int s)
+{
+  zramfree(s);
+  acquire(&swap.lock);
+  if((swap.used[s/64] & (1L << (s%64))) == 0)
+    panic("slotfree");
+  swap.used[s/64] &= ~(1L << (s%64));
+  swap.nused--;
+  release(&swap.lock);
+}
+
+// Free the slot of a swapped-out page whose PTE is being
+// cleared, as uvmunmap() frees a page.
+void
+swapfree(pte_t pte)
+{
+  slotfree(PTE2SLOT(pte));
+}
+
+// Can swapreclaim() take pages of p, whose lock the caller
+// holds?
+static int
+swapvictim(struct proc *p)
+{
+  if(p == myproc())
+    return 1;
+  return p->state == RUNNABLE && p->userpreempt;
+}
+
+// Bring the TLBs up to date after p's PTEs for [va, va+size)
+// changed. p is the current process, or is not running.
+static void
+swapflush(struct proc *p, uint64 va, uint64 size)
+{
+  if(p == myproc()){
+    uvmflush(p->pagetable, va, size);
+  } else {
+    // uvmclock() may have split a megapage.
+    kvmsync(p);
+    p->asidcpu = -1;
+  }
+}
+
+// Swap out up to SWAPBATCH user pages, chosen by the clock.
+// Returns the number of pages freed.
+int
+swapreclaim(void)
+{
+  struct {
+    struct proc *p;
+    int pid;
+    pagetable_t pagetable;
+    uint64 va;
+    pte_t pte;
+    int slot;
+  } v[SWAPBATCH];
+  struct proc *p;
+  pte_t *pte;
+  uint64 va;
+  void *spare;
+  int i, n, nscan, freed;
+
+  if(swapbusy())
+    return 0;
+
+  // choose the victims, with the clock. going around twice
+  // finds the pages that were in use the first time, if no
+  // others.
+  n = 0;
+  acquire(&swap.lock);
+  i = swap.proc;
+  va = swap.va;
+  spare = swap.spare;
+  swap.spare = 0;
+  release(&swap.lock);
+  for(nscan = 0; nscan <= 2*NPROC; nscan++){
+    p = &proc[i];
+    acquire(&p->lock);
+    if(!swapvictim(p)){
+      release(&p->lock);
+      i = (i + 1) % NPROC;
+      va = 0;
+      continue;
+    }
+    while(n < SWAPBATCH && (pte = uvmclock(p->pagetable, &va, p->sz, &spare)) != 0){
+      v[n].p = p;
+      v[n].pid = p->pid;
+      v[n].pagetable = p->pagetable;
+      v[n].va = va;
+      v[n].pte = *pte;
+      krefinc((void*)PTE2PA(*pte));
+      n++;
+      va += PGSIZE;
+    }
+    // the clock cleared PTE_A bits, which the TLBs must
+    // forget to set them again.
+    swapflush(p, 0, USERTOP);
+    release(&p->lock);
+    if(n == SWAPBATCH)
+      break;
+    i = (i + 1) % NPROC;
+    va = 0;
+  }
+  acquire(&swap.lock);
+  swap.proc = i;
+  swap.va = va;
+  release(&swap.lock);
+
+  // compress them, or write them out.
+  for(i = 0; i < n; i++){
+    if((v[i].slot = slotalloc()) >= 0 && zramstore(v[i].slot, (void*)PTE2PA(v[i].pte)) < 0)
+      virtio_disk_rwpage(SWAPDEV, v[i].slot, (void*)PTE2PA(v[i].pte), 1);
+  }
+
+  // unmap those that no one touched meanwhile.
+  freed = 0;
+  for(i = 0; i < n; i++){
+    p = v[i].p;
+    pte = 0;
+    acquire(&p->lock);
+    if(v[i].slot >= 0 && p->pid == v[i].pid &&
+       p->pagetable == v[i].pagetable && swapvictim(p))
+      pte = walk(p->pagetable, v[i].va, 0);
+    if(pte && *pte == v[i].pte){
+      *pte = SLOT2PTE(v[i].slot, v[i].pte);
+      swapflush(p, v[i].va, PGSIZE);
+      kfree((void*)PTE2PA(v[i].pte));
+      freed++;
+    } else if(v[i].slot >= 0){
+      slotfree(v[i].slot);
+    }
+    release(&p->lock);
+    kfree((void*)PTE2PA(v[i].pte));
+  }
+
+  // take back the pages zramstore() used from its reserve.
+  zramfill();
+  if(spare == 0)
+    spare = kalloc();
+  acquire(&swap.lock);
+  swap.nout += freed;
+  if(swap.spare == 0){
+    swap.spare = spare;
+    spare = 0;
+  }
+  release(&swap.lock);
+  if(spare)
+    kfree(spare);
+  return freed;
+}
+
+// Allocate a page of user memory, zeroed if zero is set,
+// swapping pages out to make room if memory has run out.
+// Returns 0 if there is none.
+void*
+swapalloc(int zero)
+{
+  void *mem;
+
+  for(;;){
+    mem = zero ? kalloc_zeroed() : kalloc();
+    if(mem || swapreclaim() == 0)
+      return mem;
+  }
+}
+
+// Read back in the swapped-out page at va in pagetable, of
+// the current process.
+// Returns 0 on success, -1 if out of memory or the caller
+// holds a spin lock.
+int
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte, old;
+  char *mem;
+  uint64 t0;
+  int z;
+
+  if(swapbusy())
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_SWAP) == 0)
+    return -1;
+  old = *pte;
+  if((mem = swapalloc(0)) == 0)
+    return -1;
+  t0 = r_time();
+  if((z = zramload(PTE2SLOT(old), mem)) < 0)
+    virtio_disk_rwpage(SWAPDEV, PTE2SLOT(old), mem, 0);
+
+  // nothing else changes the current process's PTE.
+  pte = walk(pagetable, va, 0);
+  *pte = PA2PTE(mem) | PTE_FLAGS(old) | PTE_A | PTE_V;
+  slotfree(PTE2SLOT(old));
+
+  acquire(&swap.lock);
+  swap.nin++;
+  if(z == 0){
+    swap.nzin++;
+    swap.zintime += r_time() - t0;
+  } else {
+    swap.dintime += r_time() - t0;
+  }
+  release(&swap.lock);
+  return 0;
+}
+
+void
+swapdump(void)
+{
+  uint64 ndin = swap.nin - swap.nzin;
+
+  printf("swap: %d/%d slots in use, %d pages swapped out, %d in: "
+         "%d from zram, %d us each, %d from disk, %d us each\n",
+         swap.nused, NSWAP, (int)swap.nout, (int)swap.nin,
+         (int)swap.nzin, swap.nzin ? (int)(swap.zintime / swap.nzin / (TIMEFREQ/1000000)) : 0,
+         (int)ndin, ndin ? (int)(swap.dintime / ndin / (TIMEFREQ/1000000)) : 0);
+  zramdump();
+}
@@ -23,3 +23,8 @@
 
 // System calls for labs
 #define SYS_ntas   22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_spawn  25
+#define SYS_nice   26
+#define SYS_nanosleep 27
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -283,17 +284,13 @@ create(char *path, short type, short major, short minor)
   return ip;
 }
 
-uint64
-sys_open(void)
+// Open the file at path as open() does, but without giving
+// it a file descriptor. Returns 0 on error.
+static struct file*
+fileopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
-    return -1;
 
   begin_op(ROOTDEV);
 
@@ -301,33 +298,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op(ROOTDEV);
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op(ROOTDEV);
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op(ROOTDEV);
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op(ROOTDEV);
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op(ROOTDEV);
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -345,6 +340,24 @@ sys_open(void)
   iunlock(ip);
   end_op(ROOTDEV);
 
+  return f;
+}
+
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int fd, omode;
+  struct file *f;
+
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0)
+    return -1;
+  if((f = fileopen(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -409,19 +422,25 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Fetch the argument strings of exec() or spawn() at user
+// address uargv into argv[MAXARG], a page for each.
+// Returns 0, or -1 with nothing to free.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -438,18 +457,91 @@ sys_exec(void)
       goto bad;
     }
   }
+  return 0;
+
+ bad:
+  freeargv(argv);
+  return -1;
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
   int ret = exec(path, argv);
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+  freeargv(argv);
+  return ret;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv, uact;
+  int nact;
 
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &uact) < 0 || argint(3, &nact) < 0)
+    return -1;
+  if(nact < 0 || nact > MAXSPAWNACT)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, uact, nact);
+
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// Apply the nact file actions at user address uact to the
+// open files of np, a process that spawn() is creating.
+// Returns 0, or -1 if an action fails.
+int
+spawnfiles(struct proc *np, uint64 uact, int nact)
+{
+  char path[MAXPATH];
+  struct spawnact a;
+  struct file *f;
+
+  for(int i = 0; i < nact; i++){
+    if(copyin(myproc()->pagetable, (char *)&a, uact + i*sizeof(a), sizeof(a)) < 0)
+      return -1;
+    if(a.fd < 0 || a.fd >= NOFILE)
+      return -1;
+    switch(a.type){
+    case SPAWN_OPEN:
+      if(fetchstr((uint64)a.path, path, MAXPATH) < 0)
+        return -1;
+      if((f = fileopen(path, a.mode)) == 0)
+        return -1;
+      break;
+    case SPAWN_DUP2:
+      if(a.newfd < 0 || a.newfd >= NOFILE || np->ofile[a.fd] == 0)
+        return -1;
+      f = filedup(np->ofile[a.fd]);
+      a.fd = a.newfd;
+      break;
+    case SPAWN_CLOSE:
+      f = 0;
+      break;
+    default:
+      return -1;
+    }
+    if(np->ofile[a.fd])
+      fileclose(np->ofile[a.fd]);
+    np->ofile[a.fd] = f;
+  }
+  return 0;
 }
 
 uint64
@@ -483,3 +575,30 @@ sys_pipe(void)
   return 0;
 }
 
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+
+  // addr is only a hint, and ignored.
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  return vmamap(f, len, prot, flags, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len < 0)
+    return -1;
+  return vmaunmap(myproc(), addr, len);
+}
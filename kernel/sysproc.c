@@ -56,21 +56,23 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  // until n more ticks, as uptime() counts them, have begun.
+  return timersleep((r_time() / TICKTIME + n) * TICKTIME);
+}
+
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, n;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  // round up to whole counts of the time CSR.
+  n = 1000000000 / TIMEFREQ;
+  return timersleep(r_time() + (ns + n - 1) / n);
 }
 
 uint64
@@ -83,15 +85,20 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+uint64
+sys_nice(void)
+{
+  int incr;
+
+  if(argint(0, &incr) < 0)
+    return -1;
+  return nice(incr);
+}
+
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
 {
-  uint xticks;
-
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  return r_time() / TICKTIME;
 }
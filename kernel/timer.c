@@ -0,0 +1,311 @@
+//
+// Per-hart timers.
+//
+// Each hart's CLINT mtimecmp is set for its earliest deadline
+// only: the next scheduler tick, while the hart runs
+// processes, or the earliest timer on the hart's timer wheel.
+// A hart with nothing to run stops its tick, and waits in
+// scheduler() until a timer expires or timerkick() from
+// another hart says there is work.
+//
+// timervec in kernelvec.S turns the machine-mode timer
+// interrupt into a supervisor software interrupt for
+// timerintr(), and leaves the timer off until it is set again.
+// Only the hart itself sets its mtimecmp.
+//
+// The wheel counts time in granules of 2^GSHIFT time CSR
+// counts, about 100 us, and has NWHEEL levels of WSIZE slots.
+// A timer expiring within WSIZE granules of q->clk, the next
+// granule to run, is in the slot of level 0 for its granule;
+// one further off is in the first level whose slots, each
+// WSIZE times as long as a slot of the level below, reach it.
+// When q->clk gets to the start of a slot of a higher level,
+// its timers move down to the levels below. So adding and
+// cancelling a timer take constant time, and each expiry wakes
+// only the processes whose timers have expired.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "timer.h"
+
+#define GSHIFT 10               // log2 of time CSR counts per granule
+#define WBITS 6
+#define WSIZE (1 << WBITS)      // slots per level
+#define NWHEEL 6                // levels; they reach 2^36 granules, 81 days
+
+struct timerq {
+  struct spinlock lock;
+  uint64 clk;                           // next granule to run
+  int n;                                // timers on the wheel
+  uint64 busy[NWHEEL];                  // bitmaps of non-empty slots
+  struct timer *slot[NWHEEL][WSIZE];
+  uint64 tick;            // time of the next tick, or 0 if stopped
+} timerq[NCPU];
+
+void
+timersinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&timerq[i].lock, "timerq");
+}
+
+// Put t in its slot of q, whose lock the caller holds.
+static void
+wheeladd(struct timerq *q, struct timer *t)
+{
+  struct timer **head;
+  uint64 e;
+  int l, s;
+
+  e = t->when < q->clk ? q->clk : t->when;
+  for(l = 0; l < NWHEEL-1; l++)
+    if((e >> (WBITS*l)) - (q->clk >> (WBITS*l)) < WSIZE)
+      break;
+  // the last level keeps those beyond its reach in its last
+  // slot, to add again from there.
+  if((e >> (WBITS*l)) - (q->clk >> (WBITS*l)) >= WSIZE)
+    e = ((q->clk >> (WBITS*l)) + WSIZE - 1) << (WBITS*l);
+  s = (e >> (WBITS*l)) % WSIZE;
+
+  head = &q->slot[l][s];
+  t->next = *head;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  t->slot = l*WSIZE + s;
+  t->q = q;
+  q->busy[l] |= 1UL << s;
+}
+
+// Take t off q, whose lock the caller holds.
+static void
+wheeldel(struct timerq *q, struct timer *t)
+{
+  int l = t->slot / WSIZE, s = t->slot % WSIZE;
+
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  if(q->slot[l][s] == 0)
+    q->busy[l] &= ~(1UL << s);
+  t->q = 0;
+}
+
+// Take the list of timers in slot s of level l off q.
+static struct timer*
+wheeltake(struct timerq *q, int l, int s)
+{
+  struct timer *list = q->slot[l][s];
+
+  q->slot[l][s] = 0;
+  q->busy[l] &= ~(1UL << s);
+  return list;
+}
+
+// The first granule, from q->clk on, in which q has work to
+// do: timers to expire, or a slot of a higher level to move
+// down. -1 if it is empty.
+static uint64
+wheelnext(struct timerq *q)
+{
+  uint64 next = -1, v;
+  int l, i, d;
+
+  for(l = 0; l < NWHEEL; l++){
+    if(q->busy[l] == 0)
+      continue;
+    v = q->clk >> (WBITS*l);
+    i = v % WSIZE;
+    for(d = 0; (q->busy[l] & (1UL << ((i + d) % WSIZE))) == 0; d++)
+      ;
+    v = (v + d) << (WBITS*l);
+    if(v < q->clk)
+      v = q->clk;
+    if(v < next)
+      next = v;
+  }
+  return next;
+}
+
+// Run q's granules up to now: move down the timers of each
+// higher-level slot whose start is reached, and expire the
+// timers of level 0.
+static void
+wheelrun(struct timerq *q, uint64 now)
+{
+  struct timer *t, *list;
+  uint64 c;
+  int l;
+
+  while((c = wheelnext(q)) <= now){
+    q->clk = c;
+    for(l = NWHEEL-1; l > 0; l--){
+      if(c % (1L << (WBITS*l)) != 0)
+        continue;
+      list = wheeltake(q, l, (c >> (WBITS*l)) % WSIZE);
+      while((t = list) != 0){
+        list = t->next;
+        wheeladd(q, t);
+      }
+    }
+    list = wheeltake(q, 0, c % WSIZE);
+    while((t = list) != 0){
+      list = t->next;
+      t->q = 0;
+      t->expired = 1;
+      q->n--;
+      wakeup(t->chan);
+    }
+    q->clk = c + 1;
+  }
+  // nothing else is due up to now, so the wheel can skip ahead.
+  if(q->clk <= now)
+    q->clk = now + 1;
+}
+
+// Set this hart's mtimecmp for the earliest deadline of q, its
+// wheel, whose lock the caller holds.
+static void
+timerarm(struct timerq *q)
+{
+  uint64 next, g;
+
+  next = q->tick ? q->tick : -1;
+  if((g = wheelnext(q)) != -1 && (g << GSHIFT) < next)
+    next = g << GSHIFT;
+  *(uint64*)KCLINT(CLINT_MTIMECMP(q - timerq)) = next;
+}
+
+// Handle a deadline of this hart, or a kick: expire the timers
+// whose time has come, and set the next deadline.
+// Returns 1 if the scheduler tick was due.
+int
+timerintr(void)
+{
+  struct timerq *q = &timerq[cpuid()];
+  uint64 now;
+  int tick = 0;
+
+  now = r_time();
+  acquire(&q->lock);
+  wheelrun(q, now >> GSHIFT);
+  if(q->tick && q->tick <= now){
+    tick = 1;
+    // a hart in scheduler(), with no process, stops its tick
+    // until tickstart().
+    q->tick = mycpu()->proc ? now + TICKTIME : 0;
+  }
+  timerarm(q);
+  release(&q->lock);
+  return tick;
+}
+
+// Start this hart's scheduler tick, if it stopped while the
+// hart was idle, for the process scheduler() is about to run.
+void
+tickstart(void)
+{
+  struct timerq *q = &timerq[cpuid()];
+
+  if(q->tick)
+    return;
+  acquire(&q->lock);
+  q->tick = r_time() + TICKTIME;
+  timerarm(q);
+  release(&q->lock);
+}
+
+// Interrupt hart id, to wake it if it is idle.
+void
+timerkick(int id)
+{
+  *(uint32*)KCLINT(CLINT_MSIP(id)) = 1;
+}
+
+// Add t to this hart's wheel, and return the wheel, locked.
+static struct timerq*
+timerstart(struct timer *t, uint64 when, void *chan)
+{
+  struct timerq *q;
+  uint64 now;
+
+  // the wheel is this hart's, which sets its mtimecmp; holding
+  // q->lock keeps the caller here.
+  push_off();
+  q = &timerq[cpuid()];
+  acquire(&q->lock);
+  pop_off();
+
+  now = r_time() >> GSHIFT;
+  if(q->n++ == 0 && q->clk < now)
+    q->clk = now;
+  // round up, so as not to expire early.
+  t->when = (when + (1L << GSHIFT) - 1) >> GSHIFT;
+  t->chan = chan;
+  t->expired = 0;
+  t->wheel = q;
+  wheeladd(q, t);
+  timerarm(q);
+  return q;
+}
+
+// Start t: when the time CSR reaches when, set t->expired and
+// wakeup(chan). For timeouts; see virtio_disk_io().
+void
+timeradd(struct timer *t, uint64 when, void *chan)
+{
+  release(&timerstart(t, when, chan)->lock);
+}
+
+// Stop t, if it has not expired yet.
+// Returns 1 if it had not, 0 if it had.
+int
+timercancel(struct timer *t)
+{
+  struct timerq *q = t->wheel;
+  int pending = 0;
+
+  // wheelrun() expires t under q's lock, so once we hold it,
+  // t is off the wheel or staying there, and the caller may
+  // reuse t's memory: the timer of virtio_disk_io() is on its
+  // stack.
+  acquire(&q->lock);
+  if(t->q){
+    wheeldel(q, t);
+    q->n--;
+    pending = 1;
+  }
+  release(&q->lock);
+  return pending;
+}
+
+// Sleep until the time CSR reaches when.
+// Returns 0, or -1 if killed first.
+int
+timersleep(uint64 when)
+{
+  struct timer t;
+  struct timerq *q;
+
+  if(when <= r_time())
+    return 0;
+  q = timerstart(&t, when, &t);
+  while(!t.expired){
+    if(myproc()->killed){
+      wheeldel(q, &t);
+      q->n--;
+      release(&q->lock);
+      return -1;
+    }
+    sleep(&t, &q->lock);
+  }
+  release(&q->lock);
+  return 0;
+}
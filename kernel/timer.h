@@ -0,0 +1,12 @@
+// A timer, on a hart's timer wheel from timeradd() until it
+// expires or timercancel() stops it.
+struct timer {
+  uint64 when;          // granule in which it expires
+  void *chan;           // to wakeup() then
+  int expired;          // Has it?
+  struct timerq *q;     // wheel it is on, or 0
+  struct timerq *wheel; // wheel it was last added to
+  int slot;             // index of its list in q->slot[][]
+  struct timer *next;
+  struct timer **pprev;
+};
@@ -11,6 +11,9 @@ uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
+// in ucopy.S: ucopy() returns early from here.
+extern char ucopy_fault[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -68,6 +71,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on an untouched heap page or a
+    // copy-on-write page, now mapped.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -79,9 +86,14 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt that ends its
+  // quantum. until it runs again, swapreclaim() may take its
+  // pages.
+  if(which_dev == 2 && schedtick()){
+    p->userpreempt = 1;
     yield();
+    p->userpreempt = 0;
+  }
 
   usertrapret();
 }
@@ -101,9 +113,13 @@ usertrapret(void)
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
+  // the user page table to switch to, with the process's
+  // ASID, which may be new.
+  uint64 satp = uvmsatp(p);
+
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
-  p->tf->kernel_satp = r_satp();         // kernel page table
+  p->tf->kernel_satp = MAKE_SATP(p->kpagetable, p->asid); // process's kernel page table
   p->tf->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->tf->kernel_trap = (uint64)usertrap;
   p->tf->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -120,9 +136,6 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->tf->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
-
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
@@ -145,14 +158,20 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopy && sepc < (uint64)ucopy_fault){
+    // copyin() or copyout() touched a user page that is
+    // not mapped, or is copy-on-write; let it handle that.
+    sepc = (uint64)ucopy_fault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p (%s)\n", scause, scause_desc(scause));
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this is a timer interrupt that ends the
+  // process's quantum.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -164,9 +183,9 @@ kerneltrap()
 void
 clockintr()
 {
+  // idle harts do not tick, so count the ticks from the time.
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  ticks = r_time() / TICKTIME;
   release(&tickslock);
 }
 
@@ -201,17 +220,17 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer or
+    // software interrupt, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // only the scheduler tick counts as a timer interrupt.
+    if(timerintr() == 0)
+      return 1;
+    clockintr();
     return 2;
   } else {
     return 0;
@@ -16,10 +16,15 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "timer.h"
 
 // the address of virtio mmio register r.
 #define R(n, r) ((volatile uint32 *)(VIRTION(n) + (r)))
 
+// how long to wait for a request's interrupt before looking
+// for its completion without one.
+#define TIMEOUT (5*TIMEFREQ)
+
 struct disk {
   // memory for virtio descriptors &c for queue 0.
   // this is a global instead of allocated because it has
@@ -39,7 +44,7 @@ struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *busy;  // b->disk, or virtio_disk_rwpage()'s flag
     char status;
   } info[NUM];
 
@@ -48,6 +53,8 @@ struct disk {
 
   struct spinlock vdisk_lock;
 } __attribute__ ((aligned (PGSIZE))) disk[NDISK];
+
+static void virtio_disk_done(int n);
   
 
 
@@ -121,7 +128,8 @@ virtio_disk_init(int n)
     disk[n].free[i] = 1;
 
   disk[n].init = 1;
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ
+  // and VIRTIO1_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
@@ -177,10 +185,13 @@ alloc3_desc(int n, int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(int n, struct buf *b, int write)
+// Read or write len bytes at data, a physical address, from or
+// to the disk starting at sector. Sets *busy to 1 until the
+// disk is done with data.
+static void
+virtio_disk_io(int n, uint64 sector, uint64 data, uint len, int write, int *busy)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct timer t;
 
   acquire(&disk[n].vdisk_lock);
 
@@ -194,7 +205,7 @@ virtio_disk_rw(int n, struct buf *b, int write)
     if(alloc3_desc(n, idx) == 0) {
       break;
     }
-    sleep(&disk[n].free[0], &disk[n].vdisk_lock);
+    sleepexcl(&disk[n].free[0], &disk[n].vdisk_lock);
   }
   
   // format the three descriptors.
@@ -220,8 +231,8 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk[n].desc[idx[0]].next = idx[1];
 
-  disk[n].desc[idx[1]].addr = (uint64) b->data;
-  disk[n].desc[idx[1]].len = BSIZE;
+  disk[n].desc[idx[1]].addr = data;
+  disk[n].desc[idx[1]].len = len;
   if(write)
     disk[n].desc[idx[1]].flags = 0; // device reads b->data
   else
@@ -235,9 +246,9 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
   disk[n].desc[idx[2]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[n].info[idx[0]].b = b;
+  // record the busy flag for virtio_disk_intr().
+  *busy = 1;
+  disk[n].info[idx[0]].busy = busy;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
@@ -250,33 +261,66 @@ virtio_disk_rw(int n, struct buf *b, int write)
   *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk[n].vdisk_lock);
+  timeradd(&t, r_time() + TIMEOUT, busy);
+  while(*busy == 1) {
+    sleep(busy, &disk[n].vdisk_lock);
+    if(*busy == 1 && t.expired){
+      virtio_disk_done(n);
+      if(*busy == 1)
+        printf("virtio_disk%d: sector %d: no answer in %d s\n",
+               n, (int)sector, TIMEOUT/TIMEFREQ);
+      timeradd(&t, r_time() + TIMEOUT, busy);
+    }
   }
+  timercancel(&t);
 
-  disk[n].info[idx[0]].b = 0;
+  disk[n].info[idx[0]].busy = 0;
   free_chain(n, idx[0]);
 
   release(&disk[n].vdisk_lock);
 }
 
 void
-virtio_disk_intr(int n)
+virtio_disk_rw(int n, struct buf *b, int write)
 {
-  acquire(&disk[n].vdisk_lock);
+  virtio_disk_io(n, b->blockno * (BSIZE / 512), (uint64)b->data, BSIZE,
+                 write, &b->disk);
+}
+
+// Read or write the pageno'th page of disk n, for swapping
+// user pages. pa is the page's physical address.
+void
+virtio_disk_rwpage(int n, uint pageno, void *pa, int write)
+{
+  int busy;
+
+  virtio_disk_io(n, (uint64)pageno * (PGSIZE / 512), (uint64)pa, PGSIZE,
+                 write, &busy);
+}
 
+// Finish the requests that disk n has completed.
+// Caller holds its vdisk_lock.
+static void
+virtio_disk_done(int n)
+{
   while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
     int id = disk[n].used->elems[disk[n].used_idx].id;
 
     if(disk[n].info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
+    *disk[n].info[id].busy = 0;   // disk is done with the data
+    wakeup(disk[n].info[id].busy);
 
     disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
   }
+}
 
+void
+virtio_disk_intr(int n)
+{
+  acquire(&disk[n].vdisk_lock);
+  virtio_disk_done(n);
   release(&disk[n].vdisk_lock);
 }
 
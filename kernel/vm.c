@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -13,10 +15,35 @@ pagetable_t kernel_pagetable;
 
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
+extern char erodata[]; // kernel.ld sets this to end of read-only data.
+
 extern char trampoline[]; // trampoline.S
 
 void print(pagetable_t);
 
+#define UVM_BATCH 32  // pages uvmalloc() and uvmunmap() handle at once
+#define TLB_NFLUSH 16 // most pages to flush one by one
+
+// Address-space IDs. Each process gets an ASID that tags its
+// TLB entries, so that switching satp between the process and
+// the kernel (ASID 0) needs no TLB flush. ASIDs come from a
+// counter; when it runs out, a new generation starts: each
+// process gets a new ASID the next time it returns to user
+// space, and each hart flushes its whole TLB once when it
+// first sees the new generation. See uvmsatp().
+struct {
+  struct spinlock lock;
+  uint64 gen;
+  int next;
+} asids;
+
+int asidmax;  // largest ASID the hardware supports, or 0
+
+// A page of zeros that loads from untouched user memory map
+// copy-on-write, so that memory which is only read needs no
+// page of its own. Its reference count never drops to 0.
+static char *zeropage;
+
 /*
  * create a direct-map page table for the kernel and
  * turn on paging. called early, in supervisor mode.
@@ -25,8 +52,12 @@ void print(pagetable_t);
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t) kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  initlock(&asids.lock, "asid");
+  asids.gen = 1;
+  asids.next = 1;
+
+  kernel_pagetable = (pagetable_t) kalloc_zeroed();
+  zeropage = kalloc_zeroed();
 
   // uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -37,8 +68,8 @@ kvminit()
   // virtio mmio disk interface 1
   kvmmap(VIRTION(1), VIRTION(1), PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  // CLINT, for timer.c
+  kvmmap(CLINTVA, CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
@@ -46,8 +77,11 @@ kvminit()
   // map kernel text executable and read-only.
   kvmmap(KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
+  // map kernel read-only data read-only.
+  kvmmap((uint64)etext, (uint64)etext, (uint64)erodata-(uint64)etext, PTE_R);
+
   // map kernel data and the physical RAM we'll make use of.
-  kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  kvmmap((uint64)erodata, (uint64)erodata, PHYSTOP-(uint64)erodata, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
@@ -59,10 +93,176 @@ kvminit()
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  if(cpuid() == 0){
+    // the ASID field keeps only the bits the hardware
+    // implements, possibly none.
+    w_satp(MAKE_SATP(kernel_pagetable, SATP_ASIDMASK));
+    asidmax = (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK;
+  }
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
 }
 
+// Give p a fresh ASID, which no hart has TLB entries for
+// in the current generation. Starts a new generation if
+// the ASIDs have run out.
+void
+asidalloc(struct proc *p)
+{
+  if(asidmax == 0){
+    p->asid = 0;
+    return;
+  }
+  acquire(&asids.lock);
+  if(asids.next > asidmax){
+    asids.gen++;
+    asids.next = 1;
+  }
+  p->asid = asids.next++;
+  p->asidgen = asids.gen;
+  p->asidcpu = -1;
+  release(&asids.lock);
+}
+
+// Make sure p has an ASID of the current generation, and
+// that this hart's TLB holds no stale entries for it.
+// Interrupts must be off.
+static void
+asidcheck(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if(p->asidgen != gen){
+    asidalloc(p);
+    gen = p->asidgen;
+  }
+  if(c->asidgen != gen){
+    // ASIDs of older generations may belong to others now.
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->asidcpu != cpuid()){
+    // p's page table may have changed while it ran
+    // elsewhere; drop whatever this hart kept from before.
+    sfence_vma_asid(p->asid);
+  }
+  p->asidcpu = cpuid();
+}
+
+// Return the satp value for running p's user code on this
+// hart, with p's ASID. Called by usertrapret() with
+// interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  if(asidmax == 0)
+    return MAKE_SATP(p->pagetable, 0); // trampoline flushes
+  asidcheck(p);
+  return MAKE_SATP(p->pagetable, p->asid);
+}
+
+// Create a kernel page table for a process. It has the
+// kernel's mappings, except that the part of the first
+// level-1 page-table page below USERTOP is left for
+// kvmsync() to fill in with the process's user memory.
+// Only the root and that level-1 page are the process's
+// own; the rest is shared with kernel_pagetable.
+// Returns 0 if out of memory.
+pagetable_t
+kvmcreate()
+{
+  pagetable_t kpagetable, l1, kl1;
+  int i;
+
+  if((kpagetable = (pagetable_t) kalloc()) == 0)
+    return 0;
+  if((l1 = (pagetable_t) kalloc_zeroed()) == 0){
+    kfree(kpagetable);
+    return 0;
+  }
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kl1 = (pagetable_t) PTE2PA(kernel_pagetable[0]);
+  for(i = PX(1, USERTOP); i < 512; i++)
+    l1[i] = kl1[i];
+  kpagetable[0] = PA2PTE(l1) | PTE_V;
+  return kpagetable;
+}
+
+// Free a page table made by kvmcreate().
+void
+kvmfree(pagetable_t kpagetable)
+{
+  kfree((void*)PTE2PA(kpagetable[0]));
+  kfree((void*)kpagetable);
+}
+
+// Point p's kernel page table at the page-table pages and
+// megapages that map p's user memory. The level-0 pages are
+// shared, so this is needed only when the user page table's
+// first level-1 page changes.
+void
+kvmsync(struct proc *p)
+{
+  pagetable_t l1, ul1;
+  int i;
+
+  l1 = (pagetable_t) PTE2PA(p->kpagetable[0]);
+  ul1 = 0;
+  if(p->pagetable[0] & PTE_V)
+    ul1 = (pagetable_t) PTE2PA(p->pagetable[0]);
+  for(i = 0; i < PX(1, USERTOP); i++)
+    l1[i] = ul1 ? ul1[i] : 0;
+}
+
+// Switch this hart to p's kernel page table, or to
+// kernel_pagetable if p is 0. The scheduler calls this
+// with interrupts off around running p, whose kernel code
+// can then use user addresses directly (see copyout()).
+// p's kernel and user page tables share p's ASID: they map
+// user memory the same way, and nothing else that user
+// code can reach.
+void
+kvmswitch(struct proc *p)
+{
+  if(p == 0){
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+  } else {
+    if(asidmax != 0)
+      asidcheck(p);
+    w_satp(MAKE_SATP(p->kpagetable, p->asid));
+  }
+  if(asidmax == 0)
+    sfence_vma();
+}
+
+// Bring this hart up to date after pagetable's PTEs for
+// [va, va+size) changed: update the process's kernel page
+// table, and flush the TLB entries. Only the current
+// process's page table needs this: other harts flush when the
+// process next runs on them (see asidcheck()), and a page table
+// that is not running has either a fresh ASID or asidcpu -1.
+void
+uvmflush(pagetable_t pagetable, uint64 va, uint64 size)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  kvmsync(p);
+  if(asidmax == 0){
+    sfence_vma();
+    return;
+  }
+  if(size > TLB_NFLUSH*PGSIZE){
+    sfence_vma_asid(p->asid);
+    return;
+  }
+  for(a = PGROUNDDOWN(va); a < va + size; a += PGSIZE)
+    sfence_vma_page(a, p->asid);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -75,24 +275,41 @@ kvminithart()
 //   21..39 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..12 -- 12 bits of byte offset within the page.
+//
+// *level is the level of the PTE wanted: 0 for a 4096-byte
+// page, 1 for a megapage. If va lies in a leaf at a higher
+// level, walklevel() returns that leaf's PTE instead, and
+// sets *level to its level.
 static pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
+  int l;
+
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        break;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  *level = l;
+  return &pagetable[PX(l, va)];
+}
+
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
 }
 
 // Look up a virtual address, return the physical address,
@@ -103,55 +320,81 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  // the page within a megapage, if va is in one.
+  pa = PTE2PA(*pte) + PGROUNDDOWN(va & ((1L << PXSHIFT(level)) - 1));
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// uses the largest leaves that va, pa and sz allow, so
+// that most of RAM is mapped with megapages.
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, last, n;
+  pte_t *pte;
+  int level, l;
+
+  a = PGROUNDDOWN(va);
+  last = PGROUNDUP(va + sz);
+  while(a < last){
+    for(level = 2; level > 0; level--){
+      n = 1L << PXSHIFT(level);
+      if(a % n == 0 && pa % n == 0 && last - a >= n)
+        break;
+    }
+    n = 1L << PXSHIFT(level);
+    l = level;
+    if((pte = walklevel(kernel_pagetable, a, 1, &l)) == 0)
+      panic("kvmmap");
+    if((*pte & PTE_V) || l != level)
+      panic("kvmmap: remap");
+    *pte = PA2PTE(pa) | perm | PTE_V;
+    a += n;
+    pa += n;
+  }
 }
 
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
-// assumes va is page aligned.
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE;
   pte_t *pte;
   uint64 pa;
+  int level = 0;
   
-  pte = walk(kernel_pagetable, va, 0);
+  pte = walklevel(kernel_pagetable, va, 0, &level);
   if(pte == 0)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
-  pa = PTE2PA(*pte);
-  return pa+off;
+  // the offset within the leaf, which may be a megapage.
+  pa = PTE2PA(*pte) + (va & ((1L << PXSHIFT(level)) - 1));
+  return pa;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Walks from the root only once per last-level page-table
+// page, and steps through its PTEs in between.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
@@ -160,9 +403,11 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
+  pte = 0;
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
-      return -1;
+    if(pte == 0 || PX(0, a) == 0)
+      if((pte = walk(pagetable, a, 1)) == 0)
+        return -1;
     if(*pte & PTE_V)
       panic("remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
@@ -170,52 +415,193 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
       break;
     a += PGSIZE;
     pa += PGSIZE;
+    pte++;
   }
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
+// Like mappages(), but map the n pages in pa[] at consecutive
+// virtual addresses starting at va, which must be page-aligned.
+// Returns the number of pages mapped, which is less than n if
+// a page-table page could not be allocated.
+static int
+mappagev(pagetable_t pagetable, uint64 va, int n, void **pa, int perm)
 {
-  uint64 a, last;
   pte_t *pte;
+  int i;
+
+  pte = 0;
+  for(i = 0; i < n; i++, va += PGSIZE, pte++){
+    if(pte == 0 || PX(0, va) == 0)
+      if((pte = walk(pagetable, va, 1)) == 0)
+        break;
+    if(*pte & PTE_V)
+      panic("remap");
+    *pte = PA2PTE(pa[i]) | perm | PTE_V;
+  }
+  return i;
+}
+
+// Replace the megapage leaf *pte with page-table page l0 of
+// 4096-byte mappings of the same pages, with the same
+// permissions.
+static void
+ptesplitto(pte_t *pte, pagetable_t l0)
+{
   uint64 pa;
+  uint flags;
 
-  a = PGROUNDDOWN(va);
-  last = PGROUNDDOWN(va + size - 1);
-  for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(l0) | PTE_V;
+}
+
+// Split the megapage leaf *pte with a new page-table page.
+// Returns 0 on success, -1 if there is no memory for it.
+static int
+ptesplit(pte_t *pte)
+{
+  pagetable_t l0;
+
+  if((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  ptesplitto(pte, l0);
+  return 0;
+}
+
+// Split the megapage mapping that contains va, if there is
+// one, into 4096-byte mappings. Returns 0 on success, -1 if
+// there is no memory for the new page-table page.
+static int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level = 0;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0)
+    return 0;
+  if(level != 1)
+    panic("uvmsplit");
+  return ptesplit(pte);
+}
+
+// Pages freed by uvmunmap(), handed to kfree_n() in batches.
+// A page may still be in the TLB, or in the kernel page table
+// of the process, until uvmflush(), so each batch is freed
+// only after flushing the whole range being unmapped.
+struct pgbatch {
+  pagetable_t pagetable;
+  uint64 va, size;     // the range uvmunmap() removes
+  int n;
+  void *pa[UVM_BATCH];
+};
+
+static void
+pgbatch_free(struct pgbatch *b)
+{
+  uvmflush(b->pagetable, b->va, b->size);
+  kfree_n(b->n, b->pa);
+  b->n = 0;
+}
+
+static void
+pgbatch_add(struct pgbatch *b, uint64 pa)
+{
+  if(b->n == UVM_BATCH)
+    pgbatch_free(b);
+  b->pa[b->n++] = (void*)pa;
+}
+
+// Remove the mappings for [va, end) from page-table page pt at
+// the given level. Invalid entries are cleared without
+// descending, and a page-table page is freed along with the
+// pages once the whole range it maps has been removed.
+static void
+unmaplevel(pagetable_t pt, int level, uint64 va, uint64 end, int do_free,
+           struct pgbatch *b)
+{
+  uint64 a, lo, next, sz, off, pa;
+  pte_t *pte;
+  int whole;
+
+  sz = 1L << PXSHIFT(level);
+  for(a = va; a < end; a = next){
+    lo = a & ~(sz - 1);
+    next = lo + sz;
+    pte = &pt[PX(level, a)];
     if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
+      if((*pte & PTE_SWAP) && do_free)
+        swapfree(*pte);
+      *pte = 0;  // forget a PTE_GUARD or a swapped-out page
+      continue;
     }
-    if(PTE_FLAGS(*pte) == PTE_V)
+    whole = (a == lo && next <= end);
+    if(PTE_LEAF(*pte)){
+      if(whole){
+        // clear the PTE first: pgbatch_add() may free pages.
+        pa = PTE2PA(*pte);
+        *pte = 0;
+        if(do_free)
+          for(off = 0; off < sz; off += PGSIZE)
+            pgbatch_add(b, pa + off);
+        continue;
+      }
+      // uvmunmap() has split megapages at the ends.
+      panic("uvmunmap: megapage");
+    } else if(level == 0){
       panic("uvmunmap: not a leaf");
-    if(do_free){
+    }
+    unmaplevel((pagetable_t)PTE2PA(*pte), level - 1, a, next < end ? next : end,
+               do_free, b);
+    if(whole){
       pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      *pte = 0;
+      pgbatch_add(b, pa);
     }
-    *pte = 0;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
   }
 }
 
+// Remove mappings from a page table. Pages in the range
+// that were never mapped, such as untouched parts of a
+// lazily grown heap, are skipped, as are whole subtrees with
+// nothing mapped. A megapage only partly in the range is
+// split first, and page-table pages that map nothing but
+// the range are freed. Optionally free the physical memory.
+// Returns 0, or -1 with nothing unmapped if there is no
+// memory to split a megapage.
+int
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
+{
+  struct pgbatch b;
+  uint64 end;
+
+  if(size == 0)
+    return 0;
+  end = PGROUNDUP(va + size);
+  if(va % MEGAPGSIZE != 0 && uvmsplit(pagetable, va) < 0)
+    return -1;
+  if(end % MEGAPGSIZE != 0 && end < MAXVA && uvmsplit(pagetable, end) < 0)
+    return -1;
+  b.pagetable = pagetable;
+  b.va = va;
+  b.size = size;
+  b.n = 0;
+  unmaplevel(pagetable, 2, PGROUNDDOWN(va), end, do_free, &b);
+  pgbatch_free(&b);
+  return 0;
+}
+
 // create an empty user page table.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     panic("uvmcreate: out of memory");
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -229,45 +615,50 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Allocates and maps UVM_BATCH pages at a time, with one call
+// to kalloc_zeroed_n() and one walk per page-table page.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
-  char *mem;
+  void *mem[UVM_BATCH];
   uint64 a;
+  int n, m;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
   a = oldsz;
-  for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
-    if(mem == 0){
+  for(; a < newsz; a += n*PGSIZE){
+    n = (PGROUNDUP(newsz) - a) / PGSIZE;
+    if(n > UVM_BATCH)
+      n = UVM_BATCH;
+    if(kalloc_zeroed_n(n, mem) < 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
-      kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
+    if((m = mappagev(pagetable, a, n, mem, PTE_W|PTE_X|PTE_R|PTE_U)) != n){
+      kfree_n(n - m, mem + m);
+      uvmdealloc(pagetable, a + m*PGSIZE, oldsz);
       return 0;
     }
   }
+  uvmflush(pagetable, oldsz, PGROUNDUP(newsz) - oldsz);
   return newsz;
 }
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, which is
+// oldsz if a megapage could not be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -275,14 +666,16 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     return oldsz;
 
   uint64 newup = PGROUNDUP(newsz);
-  if(newup < PGROUNDUP(oldsz))
-    uvmunmap(pagetable, newup, oldsz - newup, 1);
+  if(newup < PGROUNDUP(oldsz) && uvmunmap(pagetable, newup, oldsz - newup, 1) < 0)
+    return oldsz;
 
   return newsz;
 }
 
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
+// After uvmunmap() of the whole user range, only a few
+// page-table pages are left for it to visit.
 static void
 freewalk(pagetable_t pagetable)
 {
@@ -306,70 +699,419 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, 0, sz, 1);
+  if(sz > 0)
+    uvmunmap(pagetable, 0, sz, 1);
   freewalk(pagetable);
 }
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table only, skipping pages
+// that were never touched: the child shares
+// each physical page with the parent, and writable
+// pages become read-only copy-on-write pages in
+// both, to be copied by uvmcow() on the first store.
+// Megapages stay megapages in the child, and guard
+// pages stay guard pages.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), but for [start, end), which must be page
+// aligned. If share is set, writable pages stay writable in
+// both page tables, as for a MAP_SHARED mapping.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
+{
+  pte_t *pte, *npte;
+  uint64 pa, i, off, lsz;
+  int level, nlevel;
+
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // bring it back in to share it.
+      if(swapin(old, i) < 0)
+        goto err;
+      level = 0;
+      pte = walklevel(old, i, 0, &level);
+    }
+    if((*pte & PTE_V) == 0){
+      if(*pte & PTE_GUARD){
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        *npte = PTE_GUARD;
+      }
+      continue;
+    }
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    nlevel = level;
+    if((npte = walklevel(new, i, 1, &nlevel)) == 0)
+      goto err;
+    if((*npte & PTE_V) || nlevel != level)
+      panic("uvmcopy: remap");
+    *npte = *pte;
+    pa = PTE2PA(*pte);
+    lsz = 1L << PXSHIFT(level);
+    for(off = 0; off < lsz; off += PGSIZE)
+      krefinc((void*)(pa + off));
+    i += lsz - PGSIZE;
+  }
+  uvmflush(old, start, end - start);
+  return 0;
+
+ err:
+  uvmflush(old, start, end - start);
+  uvmunmap(new, start, i - start, 1);
+  return -1;
+}
+
+// Make the copy-on-write page at va writable, copying it
+// unless this page table holds the only reference.
+// A copy-on-write megapage is copied whole if a free
+// megapage is available, and otherwise split first.
+// Called on a store page fault and by copyout().
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, off, sz;
   uint flags;
   char *mem;
+  int level = 0, shared;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walklevel(pagetable, va, 0, &level)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  sz = 1L << PXSHIFT(level);
+
+  shared = 0;
+  for(off = 0; off < sz; off += PGSIZE)
+    if(krefcount((void*)(pa + off)) != 1)
+      shared = 1;
+  if(!shared){
+    // the other sharers have exited or copied already.
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, PGROUNDDOWN(va), PGSIZE);
+    return 0;
+  }
+
+  if(level == 0)
+    mem = swapalloc(pa == (uint64)zeropage);
+  else if((mem = kalloc_mega()) == 0){
+    // no free megapage: copy just the page at va.
+    if(uvmsplit(pagetable, va) < 0)
+      return -1;
+    return uvmcow(pagetable, va);
+  }
+  if(mem == 0)
+    return -1;
+  if(pa != (uint64)zeropage)
+    memmove(mem, (char*)pa, sz);
+  *pte = PA2PTE(mem) | flags | PTE_A;
+  uvmflush(pagetable, va & ~(sz - 1), sz);
+  for(off = 0; off < sz; off += PGSIZE)
+    kfree((void*)(pa + off));
+  return 0;
+}
+
+// Map the zero page at va, with permissions perm, but
+// copy-on-write instead of writable.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmzero(pagetable_t pagetable, uint64 va, int perm)
+{
+  if(perm & PTE_W)
+    perm = (perm & ~PTE_W) | PTE_COW;
+  if(mappages(pagetable, va, PGSIZE, (uint64)zeropage, perm) != 0)
+    return -1;
+  krefinc(zeropage);
+  return 0;
+}
+
+// Try to map a fresh zero-filled megapage at va, which must
+// be megapage-aligned, with nothing in [va, va+MEGAPGSIZE)
+// mapped yet. Returns 0 on success, -1 if that part of the
+// page table is in use or there is no free megapage.
+static int
+uvmmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  if((pte = walklevel(pagetable, va, 1, &level)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_mega()) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+  *pte = PA2PTE(mem) | PTE_W|PTE_X|PTE_R|PTE_U|PTE_V;
+  return 0;
+}
+
+// Make sure the page-table pages for va exist, swapping pages
+// out to make room for them if need be.
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmtable(pagetable_t pagetable, uint64 va)
+{
+  while(walk(pagetable, va, 1) == 0)
+    if(swapreclaim() == 0)
+      return -1;
+  return 0;
+}
+
+// Handle a page fault at va in process p. Maps a fresh
+// zero-filled page if va is in p's memory but has not been
+// touched since sbrk() grew it, or the zero page for a load,
+// reads in the page of a mapped file or a swapped-out page,
+// and resolves a store to a copy-on-write page. A store to untouched heap that covers
+// a whole aligned megapage maps one megapage if possible.
+// Returns 0 if the access can be retried, -1 if it is an
+// error.
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  uint64 a;
+  struct vma *v;
+
+  // the last page of a program segment that sbrk() has cut
+  // short is p's only up to p->sz; see vmatrim().
+  v = vmalookup(p, va);
+  if(v && v->f == 0 && va >= p->sz)
+    v = 0;
+  if(v == 0 && va >= p->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return -1;
+  }
+  if(pte && (*pte & PTE_GUARD))
+    return -1;
+  if(pte && (*pte & PTE_SWAP)){
+    if(swapin(p->pagetable, va) < 0)
+      return -1;
+    uvmflush(p->pagetable, va, PGSIZE);
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return 0;
+  }
+
+  a = MEGAPGROUNDDOWN(va);
+  if(v){
+    if(uvmtable(p->pagetable, va) < 0 || vmafault(p, v, va, write) < 0)
+      return -1;
+    p->nfault++;
+  } else if(!write){
+    // stays the zero page until the first store.
+    if(uvmtable(p->pagetable, va) < 0 ||
+       uvmzero(p->pagetable, va, PTE_W|PTE_X|PTE_R|PTE_U) < 0)
+      return -1;
+    p->nfault++;
+  } else if(a + MEGAPGSIZE <= p->sz && !vmaoverlap(p, a, a + MEGAPGSIZE) &&
+            uvmmega(p->pagetable, a) == 0){
+    p->nfault += MEGAPGSIZE / PGSIZE;
+  } else {
+    if(uvmtable(p->pagetable, va) < 0 || (mem = swapalloc(1)) == 0)
+      return -1;
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U|PTE_A) != 0){
       kfree(mem);
-      goto err;
+      return -1;
     }
+    p->nfault++;
   }
+  // the TLB may have kept the invalid PTE.
+  uvmflush(p->pagetable, va, PGSIZE);
   return 0;
+}
 
- err:
-  uvmunmap(new, 0, i, 1);
-  return -1;
+// Return the physical address of the page at va if it is
+// mapped and has been stored to since it was mapped, else 0.
+// Used to write back MAP_SHARED pages.
+uint64
+uvmdirty(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+    return 0;
+  return walkaddr(pagetable, va);
+}
+
+// Advance the clock hand *va over the user pages of pagetable
+// below end, for a page to swap out. A page whose PTE_A is set
+// has been used since the hand last passed: clear the bit and
+// go on. Return the PTE of the first other page that no one
+// else shares, leaving *va at it, or 0 with *va at end.
+// Unused megapages are split, to be swapped out page by page;
+// if kalloc() has no page for that, the page at *spare is
+// used, and *spare set to 0. The caller must flush the TLB
+// of the PTE_A bits cleared.
+pte_t*
+uvmclock(pagetable_t pagetable, uint64 *va, uint64 end, void **spare)
+{
+  pte_t *pte;
+  uint64 a;
+  int level;
+
+  for(a = PGROUNDDOWN(*va); a < end; ){
+    level = 0;
+    pte = walklevel(pagetable, a, 0, &level);
+    if(pte == 0){
+      // no level-0 page-table page here.
+      a = MEGAPGROUNDDOWN(a) + MEGAPGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U)){
+      a += PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_A) || krefcount((void*)PTE2PA(*pte)) != 1){
+      *pte &= ~PTE_A;
+      a = level ? MEGAPGROUNDDOWN(a) + MEGAPGSIZE : a + PGSIZE;
+      continue;
+    }
+    if(level){
+      if(level != 1){
+        a = MEGAPGROUNDDOWN(a) + MEGAPGSIZE;
+      } else if(ptesplit(pte) < 0){
+        if(*spare == 0){
+          a = MEGAPGROUNDDOWN(a) + MEGAPGSIZE;
+          continue;
+        }
+        ptesplitto(pte, *spare);
+        *spare = 0;
+      }
+      continue;
+    }
+    *va = a;
+    return pte;
+  }
+  *va = end;
+  return 0;
+}
+
+// Look up user address va for copyin() (write=0) or copyout()
+// (write=1), first faulting the page in if it belongs to the
+// current process and is untouched or copy-on-write.
+// Returns the physical address, or 0 if va is not accessible.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(p == 0 || p->pagetable != pagetable || uvmfault(p, va, write) < 0)
+      return 0;
+  }
+  return walkaddr(pagetable, va);
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
+// unmap the page at va and mark its PTE so that uvmfault()
+// never maps it again. used by exec for the user stack guard
+// page. clearing PTE_U would not do, since the kernel reaches
+// user memory through the same PTEs (see kvmcreate()).
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte) == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  kfree((void*)PTE2PA(*pte));
+  *pte = PTE_GUARD;
+}
+
+// Copy len bytes from src to dst, one of which is the user
+// address uva of the current process, running on its kernel
+// page table. A page fault on uva makes ucopy() return early;
+// the page is then faulted in, and the copy goes on from there.
+// Return 0 on success, -1 on error.
+static int
+copyuser(char *dst, char *src, uint64 len, uint64 uva, int write)
+{
+  struct proc *p = myproc();
+  uint64 n, va, retry;
+  pte_t *pte;
+
+  retry = -1;
+  while(len > 0){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    n = len - ucopy(dst, src, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    dst += n;
+    src += n;
+    uva += n;
+    len -= n;
+    if(len == 0)
+      break;
+
+    va = PGROUNDDOWN(uva);
+    pte = walk(p->pagetable, va, 0);
+    if(pte && (*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U) && (!write || (*pte & PTE_W))){
+      // mapped after all: the TLB had an old entry.
+      if(va == retry)
+        return -1;
+      retry = va;
+      uvmflush(p->pagetable, va, PGSIZE);
+    } else if(uvmfault(p, va, write) < 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Can copyin() or copyout() use [va, va+len) in pagetable
+// directly, through the current process's kernel page table?
+static int
+uvmdirect(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable && va < USERTOP && len <= USERTOP - va;
 }
 
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// The current process's memory is copied to directly, and
+// other page tables are walked page by page.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmdirect(pagetable, dstva, len))
+    return copyuser((char *)dstva, src, len, dstva, 1);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -386,15 +1128,20 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
+// The current process's memory is copied from directly, and
+// other page tables are walked page by page.
 // Return 0 on success, -1 on error.
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmdirect(pagetable, srcva, len))
+    return copyuser(dst, (char *)srcva, len, srcva, 0);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -409,45 +1156,55 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+// Non-zero if one of the eight bytes of w is zero.
+#define HASZERO(w) (((w) - 0x0101010101010101L) & ~(w) & 0x8080808080808080L)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
+// Translates one page at a time, and within a page looks for
+// the '\0' eight aligned bytes at a time, which never reads
+// past the end of the page.
 // Return 0 on success, -1 on error.
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, va0, pa0, w;
+  char *p, *end;
 
-  while(got_null == 0 && max > 0){
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
+    p = (char *) (pa0 + (srcva - va0));
+    end = p + n;
+    while(p < end && ((uint64)p & 7) != 0)
+      if((*dst++ = *p++) == '\0')
+        return 0;
+    while(end - p >= 8){
+      w = *(uint64 *)p;
+      if(HASZERO(w))
         break;
+      if(((uint64)dst & 7) == 0){
+        *(uint64 *)dst = w;
       } else {
-        *dst = *p;
+        for(int i = 0; i < 8; i++)
+          dst[i] = w >> (8*i);
       }
-      --n;
-      --max;
-      p++;
-      dst++;
+      p += 8;
+      dst += 8;
     }
+    while(p < end)
+      if((*dst++ = *p++) == '\0')
+        return 0;
 
+    max -= n;
     srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+  return -1;
 }
@@ -0,0 +1,437 @@
+//
+// Memory-mapped files. Each process has a table of virtual
+// memory areas (VMAs), which mmap() places top-down below
+// USERTOP and above the heap. exec() adds one VMA for each
+// segment of the program, below p->sz. A VMA's pages are read
+// in from the file by uvmfault() on first touch, straight into
+// the page that gets mapped; the pages of a MAP_SHARED mapping
+// that were stored to are written back by munmap() and exit().
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return the VMA of p that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// The lowest address of p's mmap() VMAs, which the heap must
+// stay below.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = USERTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Does [start, end) overlap one of p's VMAs?
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Find the highest free range of len bytes for a new VMA,
+// below USERTOP or just below another VMA, and above the
+// heap. Returns its start, or 0 if there is none.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  uint64 end, start, best;
+  int i;
+
+  best = 0;
+  for(i = -1; i < NVMA; i++){
+    if(i < 0)
+      end = USERTOP;
+    else if(p->vma[i].f)
+      end = p->vma[i].start;
+    else
+      continue;
+    if(end < len)
+      continue;
+    start = end - len;
+    if(start < PGROUNDUP(p->sz) || start <= best)
+      continue;
+    if(!vmaoverlap(p, start, end))
+      best = start;
+  }
+  return best;
+}
+
+// Map len bytes of f, from offset off, into the current
+// process. Returns the address, or -1 on error.
+uint64
+vmamap(struct file *f, uint64 len, int prot, int flags, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 start;
+
+  if(len == 0 || len > USERTOP || off % PGSIZE != 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(!f->readable)
+    return -1;
+  // stores to a private mapping stay in memory, so only a
+  // shared one needs a writable file.
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip == 0)
+      break;
+  if(v == &p->vma[NVMA])
+    return -1;
+  len = PGROUNDUP(len);
+  if((start = vmaplace(p, len)) == 0)
+    return -1;
+
+  v->start = start;
+  v->end = start + len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->fileend = v->end;
+  v->f = filedup(f);
+  v->ip = f->ip;
+  return start;
+}
+
+// PTE permissions for the pages of v.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Read in and map the page at va, which must be page-aligned
+// and not yet mapped, of VMA v of the current process p.
+// Returns 0 on success, -1 if the access is not allowed or
+// the page cannot be read in.
+int
+vmafault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  struct inode *ip = v->ip;
+  char *mem;
+  int busy, share, perm;
+  uint n, off;
+
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+
+  off = v->off + (va - v->start);
+  n = 0;
+  if(va < v->fileend)
+    n = v->fileend - va < PGSIZE ? v->fileend - va : PGSIZE;
+
+  // a load from the bss maps the zero page.
+  if(n == 0 && !write)
+    return uvmzero(p->pagetable, va, vmaperm(v));
+
+  // whole pages of a program come from the page cache.
+  share = v->f == 0 && n == PGSIZE;
+  if(share && (mem = (char*)pcacheget(ip, off)) != 0)
+    goto map;
+
+  // reading the file may sleep, which copyin() and copyout()
+  // cannot do while the kernel holds a spin lock, as in
+  // pipewrite(), nor while they hold ip's lock, as in a read()
+  // of the file into its own mapping. fileread() and
+  // filewrite() call vmaprefault() first.
+  if(n > 0){
+    push_off();
+    busy = mycpu()->noff > 1;
+    pop_off();
+    if(busy || holdingsleep(&ip->lock))
+      return -1;
+  }
+
+  if((mem = swapalloc(1)) == 0)
+    return -1;
+  if(n > 0){
+    ilock(ip);
+    // past the end of the file the page stays zero.
+    if(readi(ip, 0, (uint64)mem, off, n) != n)
+      share = 0;
+    if(share)
+      pcacheput(ip, off, (uint64)mem);
+    iunlock(ip);
+  }
+
+ map:
+  // a cached page is shared read-only, and copied on the first
+  // store if v is writable.
+  perm = vmaperm(v) | PTE_A;
+  if(share && (perm & PTE_W))
+    perm = (perm & ~PTE_W) | PTE_COW;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  if(share && write && (perm & PTE_COW))
+    return uvmcow(p->pagetable, va);
+  return 0;
+}
+
+// Write the stored-to pages of v in [start, end) back to
+// its file, if it is a shared writable mapping. Does not
+// make the file longer.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  // at most as much per transaction as filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  struct inode *ip = v->ip;
+  uint64 va, pa;
+  uint off, n, m, i;
+
+  if(v->flags != MAP_SHARED || (v->prot & PROT_WRITE) == 0)
+    return;
+  for(va = start; va < end; va += PGSIZE){
+    if((pa = uvmdirty(p->pagetable, va)) == 0)
+      continue;
+    off = v->off + (va - v->start);
+    n = PGSIZE;
+    for(i = 0; i < n; i += m){
+      m = n - i;
+      if(m > max)
+        m = max;
+      begin_op(ip->dev);
+      ilock(ip);
+      if(off + i >= ip->size){
+        iunlock(ip);
+        end_op(ip->dev);
+        break;
+      }
+      if(m > ip->size - (off + i))
+        m = ip->size - (off + i);
+      writei(ip, 0, pa + i, off + i, m);
+      iunlock(ip);
+      end_op(ip->dev);
+    }
+  }
+}
+
+// Unmap [addr, addr+len) of the current process p: write
+// back what is mapped there, and shrink, split or remove the
+// VMAs. Parts of the range that are not mapped by mmap() are
+// ignored. Returns 0 on success, -1 on error.
+int
+vmaunmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *w;
+  struct file *f;
+  uint64 start, end, end0;
+
+  if(addr % PGSIZE != 0 || addr >= USERTOP || len > USERTOP - addr)
+    return -1;
+  end0 = PGROUNDUP(addr + len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->f == 0)
+      continue;
+    start = addr > v->start ? addr : v->start;
+    end = end0 < v->end ? end0 : v->end;
+    if(start >= end)
+      continue;
+
+    w = 0;
+    if(v->start < start && end < v->end){
+      // a hole in the middle: the part above it needs
+      // a VMA of its own.
+      for(w = p->vma; w < &p->vma[NVMA]; w++)
+        if(w->ip == 0)
+          break;
+      if(w == &p->vma[NVMA])
+        return -1;
+    }
+
+    vmawriteback(p, v, start, end);
+    if(uvmunmap(p->pagetable, start, end - start, 1) < 0)
+      return -1;
+
+    if(w){
+      *w = *v;
+      w->off += end - v->start;
+      w->start = end;
+      filedup(w->f);
+      v->end = start;
+    } else if(start == v->start && end == v->end){
+      f = v->f;
+      v->f = 0;
+      v->ip = 0;
+      fileclose(f);
+    } else if(start == v->start){
+      v->off += end - v->start;
+      v->start = end;
+    } else {
+      v->end = start;
+    }
+  }
+  return 0;
+}
+
+// sbrk() has shrunk the current process p's memory to sz:
+// cut its program segments off there, so that memory sbrk()
+// grows again over them starts out zero, not file data.
+void
+vmatrim(struct proc *p, uint64 sz)
+{
+  struct vma *v;
+  struct inode *ip;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->f || v->ip == 0 || v->end <= sz)
+      continue;
+    if(v->start >= sz){
+      ip = v->ip;
+      v->ip = 0;
+      begin_op(ip->dev);
+      iput(ip);
+      end_op(ip->dev);
+      continue;
+    }
+    v->end = PGROUNDUP(sz);
+    if(v->fileend > sz)
+      v->fileend = sz;
+  }
+}
+
+// Give child np copies of p's VMAs, sharing the pages that
+// p has read in: those of MAP_SHARED mappings stay shared,
+// and those of MAP_PRIVATE ones become copy-on-write. The
+// pages of program segments are below p->sz, which fork()
+// has already copied.
+// Returns 0 on success, -1 if out of memory.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->ip == 0)
+      continue;
+    if(v->f && uvmcopyrange(p->pagetable, np->pagetable, v->start, v->end,
+                            v->flags == MAP_SHARED) < 0)
+      goto err;
+    np->vma[i] = *v;
+  }
+  for(i = 0; i < NVMA; i++){
+    v = &np->vma[i];
+    if(v->f)
+      filedup(v->f);
+    else if(v->ip)
+      idup(v->ip);
+  }
+  return 0;
+
+ err:
+  for(i = 0; i < NVMA; i++){
+    v = &np->vma[i];
+    if(v->f)
+      uvmunmap(np->pagetable, v->start, v->end - v->start, 1);
+    v->f = 0;
+    v->ip = 0;
+  }
+  return -1;
+}
+
+// Fault in the pages of [start, end) in [va, va+n) that are
+// not mapped, or are swapped out.
+static void
+prefault(struct proc *p, uint64 start, uint64 end, uint64 va, uint64 n, int write)
+{
+  uint64 a;
+
+  if(va > start)
+    start = PGROUNDDOWN(va);
+  if(n < end - va)
+    end = va + n;
+  for(a = start; a < end; a += PGSIZE)
+    if(walkaddr(p->pagetable, a) == 0)
+      uvmfault(p, a, write);
+}
+
+// Fault in the pages of p's memory and VMAs in [va, va+n)
+// that are not mapped yet or are swapped out, for a store if
+// write is set, so that a system call can then copy to or
+// from them while it holds a lock, under which neither
+// vmafault() can read the file nor swapin() the swap area.
+void
+vmaprefault(struct proc *p, uint64 va, uint64 n, int write)
+{
+  struct vma *v;
+
+  if(va >= USERTOP)
+    return;
+  if(va < p->sz)
+    prefault(p, 0, p->sz, va, n, write);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f && va < v->end)
+      prefault(p, v->start, v->end, va, n, write);
+}
+
+// Drop all of the current process p's VMAs, for exit() and
+// exec(). mmap() VMAs are unmapped; the pages of program
+// segments are freed with the rest of p's memory.
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+  struct inode *ip;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->f){
+      vmaunmap(p, v->start, v->end - v->start);
+    } else if(v->ip){
+      ip = v->ip;
+      v->ip = 0;
+      begin_op(ip->dev);
+      iput(ip);
+      end_op(ip->dev);
+    }
+  }
+}
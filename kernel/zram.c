@@ -0,0 +1,366 @@
+//
+// Compressed swap in memory.
+//
+// swapreclaim() first offers each page it swaps out to
+// zramstore(), which compresses it with a small LZ77 coder
+// and keeps it in an object of the smallest slab size class
+// that holds it. Only a page that does not compress to half a
+// page or less, or that does not fit in the memory set aside
+// for compressed pages, goes to the swap disk. The compressed
+// copy is named by the page's swap slot, so PTEs and the rest
+// of swap.c do not tell the two apart.
+//
+// swapreclaim() runs when kalloc() has no pages left, so the
+// slabs cannot count on kalloc() to grow. zram keeps ZRESERVE
+// pages aside for them, which zramfill() takes back from the
+// pages that swapreclaim() frees.
+//
+// Compressed format, a sequence of:
+//   token: high 4 bits literal count, low 4 bits match length - 4;
+//   if the literal count is 15, bytes added to it, up to and
+//     including the first that is not 255;
+//   the literal bytes;
+//   unless the page is then complete: the 2-byte offset back
+//     to the match, then bytes added to its length as above.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define ZMAX (PGSIZE/2)                     // largest compressed page kept
+#define ZRAMMAX ((PHYSTOP - KERNBASE) / 4)  // bytes of memory for them
+#define ZRESERVE 16                         // pages kept for the slabs
+#define NZBUCKET 1021
+#define ZHASHBITS 10
+#define MINMATCH 4
+
+// objects per slab of each size class; the classes are as
+// big as these allow.
+static int zslabobj[] = { 2, 3, 4, 6, 8, 16, 32, 64 };
+#define NZCLASS NELEM(zslabobj)
+
+// A compressed page, in an object of its size class.
+struct zobj {
+  struct zobj *next;  // in bucket[] of its slot
+  int slot;
+  int len;            // bytes of data[]
+  uchar data[];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *cache[NZCLASS];
+  uint size[NZCLASS];
+  struct zobj *bucket[NZBUCKET];  // compressed pages, by slot
+  void *reserve[ZRESERVE];        // pages for the slabs
+  int nreserve;
+
+  // one compressor's state per CPU, used with interrupts off.
+  struct {
+    ushort tab[1 << ZHASHBITS];
+    uchar buf[ZMAX];
+  } cpu[NCPU];
+
+  // statistics.
+  uint64 used;        // bytes of objects holding pages
+  uint64 nstored;     // pages held
+  uint64 zbytes;      // their compressed size
+  uint64 nreject;     // pages that went to disk instead
+} zram;
+
+void
+zraminit(void)
+{
+  static char names[NZCLASS][8];
+  uint size;
+  int i;
+
+  initlock(&zram.lock, "zram");
+  for(i = 0; i < NZCLASS; i++){
+    size = ((PGSIZE - 128) / zslabobj[i]) & ~7;
+    names[i][0] = 'z';
+    names[i][1] = '0' + i;
+    zram.cache[i] = kmem_cache_create(names[i], size, 0);
+    zram.size[i] = size;
+  }
+  zramfill();
+}
+
+// Top up the pages kept for the slabs, from kalloc().
+void
+zramfill(void)
+{
+  void *pa;
+
+  acquire(&zram.lock);
+  while(zram.nreserve < ZRESERVE && (pa = kalloc()) != 0)
+    zram.reserve[zram.nreserve++] = pa;
+  release(&zram.lock);
+}
+
+// Allocate an object of class c, with a page from the
+// reserve if the slabs cannot grow. Returns 0 if none is left.
+static struct zobj*
+zalloc(int c)
+{
+  struct zobj *o;
+  void *pa;
+
+  if((o = kmem_cache_alloc(zram.cache[c])) != 0)
+    return o;
+  pa = 0;
+  acquire(&zram.lock);
+  if(zram.nreserve > 0)
+    pa = zram.reserve[--zram.nreserve];
+  release(&zram.lock);
+  if(pa == 0)
+    return 0;
+  kmem_cache_grow(zram.cache[c], pa);
+  return kmem_cache_alloc(zram.cache[c]);
+}
+
+// The bucket of slot s, whose chain zram.lock guards.
+static struct zobj**
+zbucket(int s)
+{
+  return &zram.bucket[s % NZBUCKET];
+}
+
+// Smallest size class that holds n bytes, or -1.
+static int
+zclass(uint n)
+{
+  int i;
+
+  for(i = NZCLASS-1; i >= 0; i--)
+    if(zram.size[i] >= n)
+      return i;
+  return -1;
+}
+
+static uint
+load32(uchar *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+}
+
+// Emit the extra length bytes for a count n of 15 or more.
+static int
+putlen(uchar *dst, int o, int max, uint n)
+{
+  for(n -= 15; n >= 255; n -= 255){
+    if(o >= max)
+      return -1;
+    dst[o++] = 255;
+  }
+  if(o >= max)
+    return -1;
+  dst[o++] = n;
+  return o;
+}
+
+// Compress the n bytes at src into at most max bytes at dst.
+// Returns the compressed length, or -1 if it is longer.
+static int
+lzcompress(uchar *src, int n, uchar *dst, int max, ushort *tab)
+{
+  int i, c, o, anchor, lit, len;
+  uint x;
+
+  memset(tab, 0, sizeof(ushort) << ZHASHBITS);
+  i = anchor = o = 0;
+  while(i + MINMATCH <= n){
+    x = load32(src + i);
+    c = tab[(x * 2654435761U) >> (32 - ZHASHBITS)];
+    tab[(x * 2654435761U) >> (32 - ZHASHBITS)] = i;
+    if(c >= i || load32(src + c) != x){
+      i++;
+      continue;
+    }
+    for(len = MINMATCH; i + len < n && src[c + len] == src[i + len]; len++)
+      ;
+
+    lit = i - anchor;
+    if(o + 1 + lit + 2 > max)
+      return -1;
+    dst[o++] = ((lit < 15 ? lit : 15) << 4) | (len - MINMATCH < 15 ? len - MINMATCH : 15);
+    if(lit >= 15 && (o = putlen(dst, o, max, lit)) < 0)
+      return -1;
+    if(o + lit + 2 > max)
+      return -1;
+    memmove(dst + o, src + anchor, lit);
+    o += lit;
+    dst[o++] = (i - c) & 0xff;
+    dst[o++] = (i - c) >> 8;
+    if(len - MINMATCH >= 15 && (o = putlen(dst, o, max, len - MINMATCH)) < 0)
+      return -1;
+    i += len;
+    anchor = i;
+  }
+
+  // the last literals.
+  if(anchor < n){
+    lit = n - anchor;
+    if(o + 1 > max)
+      return -1;
+    dst[o++] = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15 && (o = putlen(dst, o, max, lit)) < 0)
+      return -1;
+    if(o + lit > max)
+      return -1;
+    memmove(dst + o, src + anchor, lit);
+    o += lit;
+  }
+  return o;
+}
+
+// Read a length continued past 15, from src[*i] on.
+static uint
+getlen(uchar *src, int *i, int len, uint n)
+{
+  uint b;
+
+  do {
+    if(*i >= len)
+      panic("zram: bad length");
+    b = src[(*i)++];
+    n += b;
+  } while(b == 255);
+  return n;
+}
+
+// Decompress len bytes at src into the n bytes at dst.
+static void
+lzdecompress(uchar *src, int len, uchar *dst, int n)
+{
+  int i, o, off;
+  uint lit, m;
+
+  i = o = 0;
+  while(o < n){
+    if(i >= len)
+      panic("zram: short");
+    lit = src[i] >> 4;
+    m = src[i] & 15;
+    i++;
+    if(lit == 15)
+      lit = getlen(src, &i, len, lit);
+    if(lit > n - o || lit > len - i)
+      panic("zram: bad literals");
+    memmove(dst + o, src + i, lit);
+    i += lit;
+    o += lit;
+    if(o == n)
+      break;
+
+    if(i + 2 > len)
+      panic("zram: short");
+    off = src[i] | (src[i+1] << 8);
+    i += 2;
+    if(m == 15)
+      m = getlen(src, &i, len, m);
+    m += MINMATCH;
+    if(off == 0 || off > o || m > n - o)
+      panic("zram: bad match");
+    // byte by byte, since the match may overlap its copy.
+    for(; m > 0; m--, o++)
+      dst[o] = dst[o - off];
+  }
+}
+
+// Keep a compressed copy of the page at pa as swap slot s.
+// Returns 0 on success, -1 if the page is to go to the disk.
+int
+zramstore(int s, void *pa)
+{
+  struct zobj *o;
+  int n, c = 0;
+
+  if(zram.used >= ZRAMMAX)
+    goto reject;
+
+  // compress into this CPU's buffer, and copy that to an
+  // object just big enough, before anything else uses it.
+  push_off();
+  o = 0;
+  n = lzcompress(pa, PGSIZE, zram.cpu[cpuid()].buf, zram.size[0] - sizeof(*o),
+                 zram.cpu[cpuid()].tab);
+  if(n > 0 && (c = zclass(n + sizeof(*o))) >= 0 && (o = zalloc(c)) != 0){
+    o->slot = s;
+    o->len = n;
+    memmove(o->data, zram.cpu[cpuid()].buf, n);
+  }
+  pop_off();
+  if(o == 0)
+    goto reject;
+
+  acquire(&zram.lock);
+  o->next = *zbucket(s);
+  *zbucket(s) = o;
+  zram.used += zram.size[c];
+  zram.nstored++;
+  zram.zbytes += n;
+  release(&zram.lock);
+  return 0;
+
+ reject:
+  acquire(&zram.lock);
+  zram.nreject++;
+  release(&zram.lock);
+  return -1;
+}
+
+// Decompress swap slot s into the page at pa, if it is kept
+// here. Returns 0 if it was, -1 if it is on the disk.
+int
+zramload(int s, void *pa)
+{
+  struct zobj *o;
+
+  // only the owner of slot s adds or frees its object, so
+  // it stays put once found.
+  acquire(&zram.lock);
+  for(o = *zbucket(s); o != 0 && o->slot != s; o = o->next)
+    ;
+  release(&zram.lock);
+  if(o == 0)
+    return -1;
+  lzdecompress(o->data, o->len, pa, PGSIZE);
+  return 0;
+}
+
+// Drop the compressed copy of swap slot s, if there is one.
+void
+zramfree(int s)
+{
+  struct zobj *o, **pp;
+  int c;
+
+  acquire(&zram.lock);
+  for(pp = zbucket(s); (o = *pp) != 0 && o->slot != s; pp = &o->next)
+    ;
+  if(o == 0){
+    release(&zram.lock);
+    return;
+  }
+  *pp = o->next;
+  c = zclass(o->len + sizeof(*o));
+  zram.used -= zram.size[c];
+  zram.nstored--;
+  zram.zbytes -= o->len;
+  release(&zram.lock);
+  kmem_cache_free(zram.cache[c], o);
+}
+
+void
+zramdump(void)
+{
+  printf("zram: %d pages compressed to %d%%, in %d KB; %d pages did not fit\n",
+         (int)zram.nstored,
+         zram.nstored ? (int)(zram.zbytes * 100 / (zram.nstored * PGSIZE)) : 0,
+         (int)(zram.used / 1024), (int)zram.nreject);
+}
@@ -0,0 +1,72 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+// Throughput of the page allocator, bd_malloc() and bd_free()
+// underneath kalloc()/kfree(). Each child repeatedly grows its
+// heap by NPAGE pages, touches them, and shrinks it again, so
+// that every page goes through one allocation and one free.
+// Run with CPUS=n: with kalloc()'s per-CPU free lists, the
+// rate of each child should stay close to that of one child.
+
+#define NCHILD 4
+#define NPAGE  16
+#define N      4000
+
+void
+child(void)
+{
+  char *a;
+
+  for(int i = 0; i < N; i++){
+    a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      printf("bdbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < NPAGE; j++)
+      a[j*PGSIZE] = 1;
+    sbrk(-NPAGE*PGSIZE);
+  }
+  exit(0);
+}
+
+void
+run(int nchild)
+{
+  int t0, t1, xstatus;
+
+  ntas(0);
+  t0 = uptime();
+  for(int i = 0; i < nchild; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bdbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      child();
+  }
+  for(int i = 0; i < nchild; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf("bdbench: %d children: %d pages in %d ticks, %d pages/tick per child\n",
+         nchild, nchild*N*NPAGE, t1-t0, N*NPAGE/(t1-t0));
+  ntas(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int n = 1; n <= NCHILD; n *= 2)
+    run(n);
+  exit(0);
+}
@@ -0,0 +1,126 @@
+//
+// tests for megapage mappings of large heaps.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define SZ (16*1024*1024)
+
+// round the break up to a megapage boundary and grow
+// the heap by SZ, so that it contains whole megapages.
+char *
+grow(void)
+{
+  char *p = sbrk(0);
+  int pad = MEGAPGROUNDUP((uint64)p) - (uint64)p;
+
+  if(sbrk(pad + SZ) == (char*)0xffffffffffffffffL){
+    printf("sbrk(%d) failed\n", pad + SZ);
+    exit(-1);
+  }
+  return p + pad;
+}
+
+void
+check(char *p, char *e, int v)
+{
+  for(char *q = p; q < e; q += PGSIZE){
+    if(*(int*)q != v + (int)((q - p) / PGSIZE)){
+      printf("wrong content at %p\n", q);
+      exit(-1);
+    }
+  }
+}
+
+void
+fill(char *p, char *e, int v)
+{
+  for(char *q = p; q < e; q += PGSIZE)
+    *(int*)q = v + (int)((q - p) / PGSIZE);
+}
+
+// touch and check every page of a big heap.
+void
+touchtest()
+{
+  printf("touch: ");
+  char *p = grow();
+  int t0 = uptime();
+  fill(p, p + SZ, 1);
+  int t1 = uptime();
+  check(p, p + SZ, 1);
+  printf("%d pages in %d ticks, ", SZ/PGSIZE, t1 - t0);
+  sbrk(-(sbrk(0) - p));
+  printf("ok\n");
+}
+
+// a child writes to half of a copy-on-write megapage heap.
+void
+forktest()
+{
+  printf("fork: ");
+  char *p = grow();
+  fill(p, p + SZ, 1);
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    fill(p, p + SZ/2 + PGSIZE, 1000000);
+    check(p, p + SZ/2 + PGSIZE, 1000000);
+    check(p + SZ/2 + PGSIZE, p + SZ, 1 + (SZ/2 + PGSIZE)/PGSIZE);
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  check(p, p + SZ, 1);
+  sbrk(-(sbrk(0) - p));
+  printf("ok\n");
+}
+
+// shrinking the heap by less than a megapage splits it.
+void
+shrinktest()
+{
+  printf("shrink: ");
+  char *p = grow();
+  fill(p, p + SZ, 1);
+
+  char *e = p + SZ - 3*PGSIZE;
+  if(sbrk(-3*PGSIZE) == (char*)0xffffffffffffffffL){
+    printf("sbrk(-%d) failed\n", 3*PGSIZE);
+    exit(-1);
+  }
+  check(p, e, 1);
+
+  // the freed pages come back zero-filled.
+  sbrk(3*PGSIZE);
+  for(char *q = e; q < p + SZ; q += PGSIZE){
+    if(*(int*)q != 0){
+      printf("page not zero at %p\n", q);
+      exit(-1);
+    }
+  }
+  sbrk(-(sbrk(0) - p));
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  touchtest();
+  forktest();
+  shrinktest();
+
+  // check that the earlier tests freed their memory.
+  touchtest();
+
+  printf("ALL MEGAPAGE TESTS PASSED\n");
+  exit(0);
+}
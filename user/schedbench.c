@@ -0,0 +1,71 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Response time of an interactive process while CPU-bound ones
+// run. The interactive one sleeps for a tick at a time, as a
+// shell waiting for keystrokes would, and each sleep(1) should
+// take one tick; the ticks beyond that are the time it waited
+// to run again. With the multi-level feedback queue, the hogs
+// drop to low levels and the interactive process runs first.
+
+#define NHOG (NPROC-4)  // besides init, sh, schedbench and one spare
+#define N    40
+
+void
+hog(void)
+{
+  volatile uint x = 0;
+
+  for(;;)
+    x++;
+}
+
+void
+run(int nhog)
+{
+  int pids[NHOG], i, t0, d, total, max;
+
+  for(i = 0; i < nhog; i++){
+    if((pids[i] = fork()) < 0){
+      printf("schedbench: fork failed\n");
+      // don't leave the hogs spinning.
+      while(--i >= 0){
+        kill(pids[i]);
+        wait(0);
+      }
+      exit(1);
+    }
+    if(pids[i] == 0)
+      hog();
+  }
+
+  // let the hogs use up their quanta.
+  sleep(20);
+
+  total = max = 0;
+  for(i = 0; i < N; i++){
+    t0 = uptime();
+    sleep(1);
+    d = uptime() - t0 - 1;
+    total += d;
+    if(d > max)
+      max = d;
+  }
+  printf("schedbench: %d hogs: %d sleeps of 1 tick, %d ticks late in all, at most %d\n",
+         nhog, N, total, max);
+
+  for(i = 0; i < nhog; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  run(0);
+  run(NHOG);
+  exit(0);
+}
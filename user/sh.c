@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 
 // Execute cmd.  Never returns.
 void
@@ -130,6 +132,100 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Can cmd be run with spawn() from the shell itself, without
+// a forked copy of the shell? Not if it has to run in the
+// background, nor a list that is part of a bigger command:
+// its commands must run one after another with the same files.
+int
+spawnable(struct cmd *cmd, int top)
+{
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return 1;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd, 0);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left, 0) && spawnable(pcmd->right, 0);
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    return top && spawnable(lcmd->left, 1) && spawnable(lcmd->right, 1);
+  }
+  return 0;
+}
+
+// Start the programs of a spawnable cmd, applying the nact
+// file actions in act to each, then those of cmd itself.
+// Returns the number of processes started, for the caller
+// to wait for.
+int
+spawncmd(struct cmd *cmd, struct spawnact *act, int nact)
+{
+  int p[2], n;
+  struct spawnact a[MAXSPAWNACT];
+  struct execcmd *ecmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(nact + 3 > MAXSPAWNACT){
+    fprintf(2, "too many redirections\n");
+    return 0;
+  }
+  memmove(a, act, nact*sizeof(a[0]));
+
+  switch(cmd->type){
+  default:
+    panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, a, nact) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    a[nact].type = SPAWN_OPEN;
+    a[nact].fd = rcmd->fd;
+    a[nact].mode = rcmd->mode;
+    a[nact].path = rcmd->file;
+    return spawncmd(rcmd->cmd, a, nact+1);
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    for(n = spawncmd(lcmd->left, a, nact); n > 0; n--)
+      wait(0);
+    return spawncmd(lcmd->right, a, nact);
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0)
+      panic("pipe");
+    a[nact+1].type = SPAWN_CLOSE;
+    a[nact+1].fd = p[0];
+    a[nact+2].type = SPAWN_CLOSE;
+    a[nact+2].fd = p[1];
+    a[nact].type = SPAWN_DUP2;
+    a[nact].fd = p[1];
+    a[nact].newfd = 1;
+    n = spawncmd(pcmd->left, a, nact+3);
+    a[nact].fd = p[0];
+    a[nact].newfd = 0;
+    n += spawncmd(pcmd->right, a, nact+3);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -145,7 +241,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -164,9 +261,20 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    // parse here, so that most commands can be started with
+    // spawn(), at a cost that does not depend on the shell's
+    // size as fork() does.
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd, 1)){
+      for(n = spawncmd(cmd, 0, 0); n > 0; n--)
+        wait(0);
+    } else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -256,6 +364,42 @@ backcmd(struct cmd *subcmd)
   cmd->cmd = subcmd;
   return (struct cmd*)cmd;
 }
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
 //PAGEBREAK!
 // Parsing
 
@@ -319,6 +463,18 @@ peek(char **ps, char *es, char *toks)
   return *s && strchr(toks, *s);
 }
 
+// The parser runs in the shell itself, so a syntax error is
+// reported and remembered instead of exiting.
+int syntaxerr;
+
+void
+syntax(char *s)
+{
+  if(!syntaxerr)
+    fprintf(2, "%s\n", s);
+  syntaxerr = 1;
+}
+
 struct cmd *parseline(char**, char*);
 struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
@@ -330,12 +486,17 @@ parsecmd(char *s)
   char *es;
   struct cmd *cmd;
 
+  syntaxerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !syntaxerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(syntaxerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +540,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +568,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +596,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS-1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -0,0 +1,75 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Cost of fetching path names and exec arguments from user
+// memory with copyinstr(). Both system calls fail right after
+// the fetch: open() of a missing file in /, and exec() of a
+// missing program, which copies in all of its argv strings
+// before looking up the path.
+
+#define NOPEN 20000
+#define NEXEC 2000
+#define ARGLEN 1000
+
+char path[MAXPATH];
+char args[MAXARG-1][ARGLEN];
+char *xargv[MAXARG];
+
+void
+benchopen(void)
+{
+  int t0, t1;
+
+  memset(path, 'p', sizeof(path) - 1);
+  path[0] = '/';
+  path[sizeof(path) - 1] = '\0';
+
+  t0 = uptime();
+  for(int i = 0; i < NOPEN; i++){
+    if(open(path, 0) >= 0){
+      printf("strbench: open %s succeeded\n", path);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf("strbench: open: %d paths of %d bytes in %d ticks, %d/tick\n",
+         NOPEN, MAXPATH-1, t1 - t0, NOPEN/(t1-t0));
+}
+
+void
+benchexec(void)
+{
+  int t0, t1, i;
+
+  // start the strings at all offsets within a word.
+  for(i = 0; i < MAXARG-1; i++){
+    memset(args[i], 'a' + i % 26, ARGLEN - 1);
+    xargv[i] = args[i] + i % 8;
+  }
+  xargv[i] = 0;
+
+  t0 = uptime();
+  for(i = 0; i < NEXEC; i++){
+    if(exec("/strbench-missing", xargv) >= 0){
+      printf("strbench: exec succeeded\n");
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf("strbench: exec: %d calls with %d args of about %d bytes in %d ticks, %d/tick\n",
+         NEXEC, MAXARG-1, ARGLEN, t1 - t0, NEXEC/(t1-t0));
+}
+
+int
+main(int argc, char *argv[])
+{
+  benchopen();
+  benchexec();
+  exit(0);
+}
@@ -0,0 +1,157 @@
+//
+// tests for swapping to zram and the second disk: heaps larger
+// than physical memory (128 MB).
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define SZ (160*1024*1024)   // below USERTOP, with room for the program
+
+char *
+grow(int n)
+{
+  char *p = sbrk(n);
+
+  if(p == (char*)0xffffffffffffffffL){
+    printf("sbrk(%d) failed\n", n);
+    exit(-1);
+  }
+  return p;
+}
+
+void
+check(char *p, char *e, int v)
+{
+  for(char *q = p; q < e; q += PGSIZE){
+    if(*(int*)q != v + (int)((q - p) / PGSIZE)){
+      printf("wrong content at %p\n", q);
+      exit(-1);
+    }
+  }
+}
+
+void
+fill(char *p, char *e, int v)
+{
+  for(char *q = p; q < e; q += PGSIZE)
+    *(int*)q = v + (int)((q - p) / PGSIZE);
+}
+
+// fill every word of each page with a pseudo-random value, so
+// that the pages do not compress and go to the disk.
+void
+fillrand(char *p, char *e, uint seed, int check)
+{
+  for(uint *q = (uint*)p; q < (uint*)e; q++){
+    seed = seed * 1103515245 + 12345;
+    if(check && *q != seed){
+      printf("wrong content at %p\n", q);
+      exit(-1);
+    }
+    *q = seed;
+  }
+}
+
+// write every page of a heap that does not fit in memory,
+// then read them all back, twice.
+void
+bigtest()
+{
+  printf("big: ");
+  char *p = grow(SZ);
+  int t0 = uptime();
+  fill(p, p + SZ, 1);
+  check(p, p + SZ, 1);
+  check(p, p + SZ, 1);
+  int t1 = uptime();
+  printf("%d pages in %d ticks, ", SZ/PGSIZE, t1 - t0);
+  sbrk(-SZ);
+  printf("ok\n");
+}
+
+// pages that zram cannot keep.
+void
+randtest()
+{
+  printf("random: ");
+  char *p = grow(SZ);
+  fillrand(p, p + SZ, 1, 0);
+  fillrand(p, p + SZ, 1, 1);
+  sbrk(-SZ);
+  printf("ok\n");
+}
+
+// parent and child both keep a swapped heap.
+void
+forktest()
+{
+  printf("fork: ");
+  char *p = grow(SZ/2);
+  fill(p, p + SZ/2, 1);
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    char *q = grow(SZ/2);
+    fill(q, q + SZ/2, 2000000);
+    check(p, p + SZ/2, 1);
+    check(q, q + SZ/2, 2000000);
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  check(p, p + SZ/2, 1);
+  sbrk(-SZ/2);
+  printf("ok\n");
+}
+
+// read() and write() of a pipe copy to and from pages that
+// have been swapped out, holding the pipe's lock.
+void
+pipetest()
+{
+  printf("pipe: ");
+  char *p = grow(SZ);
+  int fds[2];
+
+  fill(p, p + SZ, 1);
+  if(pipe(fds) < 0){
+    printf("pipe failed\n");
+    exit(-1);
+  }
+  // the first pages were swapped out to make room for the
+  // last ones.
+  for(char *q = p; q < p + 64*PGSIZE; q += PGSIZE){
+    if(write(fds[1], q, 256) != 256 || read(fds[0], q + SZ/2, 256) != 256){
+      printf("pipe copy failed\n");
+      exit(-1);
+    }
+  }
+  check(p + SZ/2, p + SZ/2 + 64*PGSIZE, 1);
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-SZ);
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  bigtest();
+  randtest();
+  forktest();
+  pipetest();
+
+  // check that the earlier tests freed their swap space.
+  bigtest();
+
+  printf("ALL SWAP TESTS PASSED\n");
+  exit(0);
+}
@@ -0,0 +1,40 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Resolution of nanosleep(). For each length, sleep for that
+// long, over and over for about two seconds, and report the
+// average time each sleep took: the length, plus the time to
+// take the timer interrupt and run again. sleep(1) could not
+// sleep for less than a clock tick, 100 ms.
+
+#define TOTAL 2000000000ULL   // ns to sleep for in all
+
+void
+bench(uint64 ns)
+{
+  int n = TOTAL / ns;
+  int t0, t1;
+
+  t0 = uptime();
+  for(int i = 0; i < n; i++){
+    if(nanosleep(ns) < 0){
+      printf("timerbench: nanosleep failed\n");
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  // a tick is 100000 us.
+  printf("timerbench: %d sleeps of %d us: %d us each\n",
+         n, (int)(ns / 1000), (int)((uint64)(t1 - t0) * 100000 / n));
+}
+
+int
+main(int argc, char *argv[])
+{
+  bench(100000);
+  bench(1000000);
+  bench(10000000);
+  exit(0);
+}
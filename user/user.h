@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct spawnact;
 
 // system calls
 int fork(void);
@@ -27,6 +28,11 @@ int ntas();
 int crash(const char*, int);
 int mount(char*, char *);
 int umount(char*);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int spawn(char*, char**, struct spawnact*, int);
+int nice(int);
+int nanosleep(uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -1590,9 +1590,28 @@ sbrkbasic(char *s)
   char *c, *a, *b;
 
   // does sbrk() return the expected failure value?
-  a = sbrk(TOOMUCH);
-  if(a != (char*)0xffffffffffffffffL){
-    printf("%s: sbrk(<toomuch>) returned %p\n", a);
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed in sbrkbasic\n");
+    exit(1);
+  }
+  if(pid == 0){
+    a = sbrk(TOOMUCH);
+    if(a == (char*)0xffffffffffffffffL){
+      // it's OK if this fails.
+      exit(0);
+    }
+    for(b = a; b < a+TOOMUCH; b += 4096){
+      *b = 99;
+    }
+    // we should not get here! either sbrk(TOOMUCH)
+    // should have failed, or (with lazy allocation)
+    // a pagefault should have killed this process.
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus == 1){
+    printf("%s: too much memory allocated!\n", s);
     exit(1);
   }
 